@@ -0,0 +1,1161 @@
+// Benchmark harness for cline: runs ./cline under a pseudo-terminal, replays
+// scripted keystroke traces (typing, scrolling, pasting, resize storms) on
+// generated files from 1K to 1G and reports keystroke to frame latency
+// percentiles, bytes written per frame and peak RSS.
+//
+// The editor core is also compiled in, to drive screen_refresh in-process
+// against a virtual terminal that checks every frame and measures frames per
+// second in incremental and whole-screen rendering.
+//
+// BENCH_SIZES overrides the file sizes (e.g. "1K,1M"), BENCH_DIR the directory
+// the files are generated in (/tmp/cline-bench).
+
+#define _XOPEN_SOURCE 700
+
+#define main cline_main
+#include "cline.c"
+#undef main
+
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#define BENCH_DEFAULT_SIZES "1K,1M,100M,1G"
+#define BENCH_ROWS 40
+#define BENCH_COLUMNS 120
+#define BENCH_TIMEOUT 5000        // ms to wait for a frame
+#define BENCH_OPEN_TIMEOUT 60000  // ms to wait for the first frame
+
+// A cline process running on the master side of a pseudo-terminal
+typedef struct session {
+  pid_t pid;
+  const char *filename;
+  int master;
+  char *output;                 // everything not yet consumed by a frame wait
+  size_t length;
+  size_t capacity;
+  long long bytes;              // written by cline since the last frame wait
+} session;
+
+// Latencies (us) and sizes of the frames of one trace
+typedef struct samples {
+  long long *latencies;
+  long long *bytes;
+  int count;
+  int capacity;
+} samples;
+
+void samples_add(samples *s, long long latency, long long bytes) {
+  if (s->count == s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 256;
+    s->latencies = realloc(s->latencies, s->capacity * sizeof(long long));
+    s->bytes = realloc(s->bytes, s->capacity * sizeof(long long));
+    if (s->latencies == NULL || s->bytes == NULL) exit(1);
+  }
+  s->latencies[s->count] = latency;
+  s->bytes[s->count] = bytes;
+  s->count++;
+}
+
+int samples_compare(const void *a, const void *b) {
+  long long x = *(const long long *)a, y = *(const long long *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+void samples_report(const char *file, const char *trace, samples *s, 
+                    long long rss) {
+  long long total = 0;
+
+  if (s->count == 0) {
+    printf("%-10s %-8s   no frames\n", file, trace);
+    return;
+  }
+  for (int i = 0; i < s->count; i++) total += s->bytes[i];
+  qsort(s->latencies, s->count, sizeof(long long), samples_compare);
+  printf("%-10s %-8s %6d %9.2f %9.2f %9.2f %9.2f %10.1f %9lld\n",
+         file, trace, s->count,
+         s->latencies[s->count / 2] / 1000.0,
+         s->latencies[s->count * 9 / 10] / 1000.0,
+         s->latencies[s->count * 99 / 100] / 1000.0,
+         s->latencies[s->count - 1] / 1000.0,
+         (double)total / s->count, rss / 1024);
+  s->count = 0;
+}
+
+// Sizes -----------------------------------------------------------------------
+
+long long bench_parse_size(const char *s) {
+  char *end;
+  long long size = strtoll(s, &end, 10);
+
+  switch (*end) {
+  case 'K': case 'k': return size << 10;
+  case 'M': case 'm': return size << 20;
+  case 'G': case 'g': return size << 30;
+  }
+  return size;
+}
+
+// Write size bytes of Lisp-looking source, with TABs, non-ASCII chars and
+// lines of varying length, ending in CRLF when asked to. Files already
+// generated are reused when they start as they should.
+int bench_generate(const char *filename, long long size, bool crlf) {
+  static const char *lines[] = {
+    "(defun fact (n)\n",
+    "\t(if (<= n 1)\n",
+    "\t\t1\n",
+    "\t\t(* n (fact (- n 1)))))\n",
+    "\n",
+    ";; a longer comment line, to have rows wider than a few columns, as in "
+    "real code where they run past the right margin of the terminal\n",
+    "(defparameter *table* (make-hash-table :test #'equal))\n",
+    ";; caf\xc3\xa9 na\xc3\xafve re\xcc\x81sume\xcc\x81 \xe2\x80\x94 "
+    "\xe6\x97\xa5\xe6\x9c\xac\xe8\xaa\x9e\xe3\x81\xae\xe3\x82\xb3"
+    "\xe3\x83\xa1\xe3\x83\xb3\xe3\x83\x88 (\xce\xbb (x) x) "
+    "\xe5\xae\xbd\xe5\xad\x97\xe7\xac\xa6\xe5\x8d\xa0\xe4\xb8\xa4"
+    "\xe5\x88\x97\xef\xbc\x8c\xe4\xb8\x80\xe7\x9b\xb4\xe5\x86\x99"
+    "\xe5\x88\xb0\xe7\xbb\x88\xe7\xab\xaf\xe7\x9a\x84\xe5\x8f\xb3"
+    "\xe8\xbe\xb9\xe7\xbc\x98\xe4\xb9\x8b\xe5\xa4\x96\xef\xbc\x8c"
+    "\xe8\xbf\x98\xe5\x9c\xa8\xe7\xbb\xa7\xe7\xbb\xad\xe5\x86\x99"
+    "\xe4\xb8\x8b\xe5\x8e\xbb\xe3\x80\x82\n",
+  };
+  char block[64 * 1024], head[64 * 1024];
+  size_t used = 0;
+  struct stat st;
+  FILE *fp;
+
+  for (int i = 0; used < sizeof(block) - 256; i++) {
+    const char *line = lines[i % (sizeof(lines) / sizeof(lines[0]))];
+    size_t length = strlen(line) - 1;
+
+    memcpy(block + used, line, length);
+    used += length;
+    if (crlf) block[used++] = '\r';
+    block[used++] = '\n';
+  }
+
+  if (stat(filename, &st) == 0 && st.st_size == size &&
+      (fp = fopen(filename, "r")) != NULL) {
+    size_t n = size < (long long)used ? (size_t)size : used;
+    bool same = fread(head, 1, n, fp) == n && memcmp(head, block, n) == 0;
+
+    fclose(fp);
+    if (same) return 0;
+  }
+  if ((fp = fopen(filename, "w")) == NULL) return -1;
+  for (long long written = 0; written < size; written += used) {
+    size_t n = size - written < (long long)used ? (size_t)(size - written) : used;
+    if (fwrite(block, 1, n, fp) != n) {
+      fclose(fp);
+      return -1;
+    }
+  }
+  return fclose(fp);
+}
+
+// Sessions --------------------------------------------------------------------
+
+void session_resize(session *s, int rows, int columns) {
+  struct winsize size = {0};
+
+  size.ws_row = rows;
+  size.ws_col = columns;
+  ioctl(s->master, TIOCSWINSZ, &size);
+}
+
+// Sessions are killed: remove the journal they leave next to filename, it is
+// not to be replayed
+void session_remove_journal(const char *filename) {
+  const char *base = strrchr(filename, '/');
+  char name[1024];
+
+  base = base ? base + 1 : filename;
+  snprintf(name, sizeof(name), "%.*s.%s.journal", (int)(base - filename),
+           filename, base);
+  unlink(name);
+}
+
+int session_start(session *s, const char *filename) {
+  char *slave_name;
+
+  memset(s, 0, sizeof(*s));
+  s->filename = filename;
+  session_remove_journal(filename);
+  if ((s->master = posix_openpt(O_RDWR | O_NOCTTY)) == -1) return -1;
+  if (grantpt(s->master) == -1 || unlockpt(s->master) == -1) return -1;
+  if ((slave_name = ptsname(s->master)) == NULL) return -1;
+  session_resize(s, BENCH_ROWS, BENCH_COLUMNS);
+
+  if ((s->pid = fork()) == -1) return -1;
+  if (s->pid == 0) {
+    int slave;
+
+    setsid();
+    if ((slave = open(slave_name, O_RDWR)) == -1) _exit(127);
+    ioctl(slave, TIOCSCTTY, 0);
+    dup2(slave, STDIN_FILENO);
+    dup2(slave, STDOUT_FILENO);
+    dup2(slave, STDERR_FILENO);
+    close(slave);
+    close(s->master);
+    execl("./cline", "cline", filename, (char *)NULL);
+    _exit(127);
+  }
+  return 0;
+}
+
+// Peak resident set size of the session, in bytes
+long long session_peak_rss(session *s) {
+  char path[64], line[256];
+  long long rss = 0;
+  FILE *fp;
+
+  snprintf(path, sizeof(path), "/proc/%d/status", (int)s->pid);
+  if ((fp = fopen(path, "r")) == NULL) return 0;
+  while (fgets(line, sizeof(line), fp)) {
+    if (sscanf(line, "VmHWM: %lld kB", &rss) == 1) break;
+  }
+  fclose(fp);
+  return rss * 1024;
+}
+
+void session_stop(session *s) {
+  kill(s->pid, SIGKILL);
+  waitpid(s->pid, NULL, 0);
+  session_remove_journal(s->filename);
+  close(s->master);
+  free(s->output);
+}
+
+void session_send(session *s, const char *keys, size_t length) {
+  while (length > 0) {
+    ssize_t n = write(s->master, keys, length);
+
+    if (n == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return;
+    }
+    keys += n;
+    length -= n;
+  }
+}
+
+// Read what cline wrote, waiting at most timeout ms. Returns false on timeout.
+bool session_read(session *s, int timeout) {
+  struct pollfd fd = {s->master, POLLIN, 0};
+  ssize_t n;
+
+  if (poll(&fd, 1, timeout) <= 0) return false;
+  if (s->length + 65536 > s->capacity) {
+    s->capacity = s->capacity ? s->capacity * 2 : 1 << 20;
+    while (s->length + 65536 > s->capacity) s->capacity *= 2;
+    if ((s->output = realloc(s->output, s->capacity)) == NULL) exit(1);
+  }
+  if ((n = read(s->master, s->output + s->length, 65536)) <= 0) return false;
+  s->length += n;
+  s->bytes += n;
+  return true;
+}
+
+// Wait until cline finishes a frame: a painted frame ends by showing the
+// cursor again (frames only moving the cursor are not seen, traces only use
+// keys that change the screen). Returns the bytes of the frame, -1 on timeout.
+long long session_wait_frame(session *s, int timeout) {
+  static const char marker[] = "\x1b[?25h";
+  long long deadline = stats_now() + timeout * 1000LL, bytes;
+  size_t scanned = 0;
+
+  while (1) {
+    for (; scanned + sizeof(marker) - 1 <= s->length; scanned++) {
+      if (memcmp(s->output + scanned, marker, sizeof(marker) - 1) != 0) {
+        continue;
+      }
+      scanned += sizeof(marker) - 1;
+      memmove(s->output, s->output + scanned, s->length - scanned);
+      s->length -= scanned;
+      bytes = s->bytes - s->length;
+      s->bytes = s->length;
+      return bytes;
+    }
+    long long left = (deadline - stats_now()) / 1000;
+    if (left <= 0 || !session_read(s, left)) return -1;
+  }
+}
+
+// Read until cline stays quiet for quiet ms, returns the bytes read
+long long session_settle(session *s, int quiet) {
+  long long bytes;
+
+  while (session_read(s, quiet));
+  bytes = s->bytes;
+  s->bytes = 0;
+  s->length = 0;
+  return bytes;
+}
+
+// Send one key and time the frame it causes. Returns false when the key
+// caused no frame within timeout ms
+bool session_key(session *s, samples *out, const char *key, int timeout) {
+  long long start = stats_now(), bytes;
+
+  session_send(s, key, strlen(key));
+  if ((bytes = session_wait_frame(s, timeout)) == -1) return false;
+  samples_add(out, stats_now() - start, bytes);
+  return true;
+}
+
+// Traces ----------------------------------------------------------------------
+
+static const char SEQUENCE_UP[] = "\x1b[A";
+static const char SEQUENCE_DOWN[] = "\x1b[B";
+
+void trace_typing(session *s, samples *out) {
+  char key[2] = {0, 0};
+
+  for (int i = 0; i < 500; i++) {
+    key[0] = "(defun bench (x) (+ x 1))"[i % 25];
+    session_key(s, out, key, BENCH_TIMEOUT);
+  }
+}
+
+// Move down line by line, turning back at the ends of short files
+void trace_scrolling(session *s, samples *out) {
+  const char *key = SEQUENCE_DOWN;
+
+  for (int i = 0; i < 500; i++) {
+    if (!session_key(s, out, key, 200)) {
+      key = key == SEQUENCE_DOWN ? SEQUENCE_UP : SEQUENCE_DOWN;
+    }
+  }
+}
+
+// Bracketed pastes of 64K, each one should come back as a single frame
+void trace_paste(session *s, samples *out) {
+  static char paste[64 * 1024 + 16];
+  size_t length = 0;
+
+  length += sprintf(paste, "\x1b[200~");
+  while (length < sizeof(paste) - 64) {
+    length += sprintf(paste + length, "(paste (list 1 2 3) \"text\")\r");
+  }
+  length += sprintf(paste + length, "\x1b[201~");
+
+  for (int i = 0; i < 10; i++) {
+    long long start = stats_now(), bytes, latency;
+
+    session_send(s, paste, length);
+    if ((bytes = session_wait_frame(s, BENCH_TIMEOUT)) == -1) return;
+    latency = stats_now() - start;
+    samples_add(out, latency, bytes + session_settle(s, 50));
+  }
+}
+
+// Drag the window: 100 size changes in a row, each storm ending on another
+// size, then time until the screen is redrawn. One sample per storm.
+void trace_resize(session *s, samples *out) {
+  for (int storm = 0; storm < 10; storm++) {
+    long long start = stats_now(), bytes, latency;
+    int shrink = storm % 2 ? 0 : 5;
+
+    for (int i = 0; i < 100; i++) {
+      session_resize(s, BENCH_ROWS - (i % 10), BENCH_COLUMNS - (i % 20));
+    }
+    session_resize(s, BENCH_ROWS - shrink, BENCH_COLUMNS - shrink);
+    if ((bytes = session_wait_frame(s, BENCH_TIMEOUT)) == -1) return;
+    latency = stats_now() - start;
+    samples_add(out, latency, bytes + session_settle(s, 50));
+  }
+}
+
+void bench_file(const char *name, const char *filename) {
+  samples out = {0};
+  session s;
+  long long start = stats_now(), bytes;
+
+  if (session_start(&s, filename) == -1) {
+    perror("Unable to start cline");
+    exit(1);
+  }
+  if ((bytes = session_wait_frame(&s, BENCH_OPEN_TIMEOUT)) == -1) {
+    fprintf(stderr, "%s: no first frame\n", name);
+    session_stop(&s);
+    return;
+  }
+  samples_add(&out, stats_now() - start, bytes);
+  session_settle(&s, 100);
+  samples_report(name, "open", &out, session_peak_rss(&s));
+
+  trace_typing(&s, &out);
+  samples_report(name, "typing", &out, session_peak_rss(&s));
+  trace_scrolling(&s, &out);
+  samples_report(name, "scroll", &out, session_peak_rss(&s));
+  trace_paste(&s, &out);
+  samples_report(name, "paste", &out, session_peak_rss(&s));
+  trace_resize(&s, &out);
+  samples_report(name, "resize", &out, session_peak_rss(&s));
+
+  session_stop(&s);
+  free(out.latencies);
+  free(out.bytes);
+}
+
+// Virtual terminal ------------------------------------------------------------
+
+// In-process model of the VT100 subset cline emits: the output of a frame is
+// parsed into a grid of cells, to check it shows exactly what cline meant to
+// show and to measure what the terminal side has to chew through. Frames are
+// fed VT_READ_SIZE bytes at a time, the packets of a network link: a terminal
+// shows the screen after each read, half drawn when a frame spans reads,
+// unless the frame is a synchronized update (DEC mode 2026). Cells hold a
+// column each, as in cline: the UTF-8 bytes received are decoded into chars
+// taking the columns render_width gives them.
+#define VT_READ_SIZE 1024
+enum VT_STATES {
+  VT_GROUND,
+  VT_ESCAPE,
+  VT_CSI
+};
+
+typedef struct vt {
+  int rows;
+  int columns;
+  uint32_t *chars;              // packed UTF-8 bytes, or CELL_WIDE
+  unsigned char *attributes;    // CELL_NORMAL or CELL_REVERSE
+  int y;                        // cursor, 0 based
+  int x;
+  int top;                      // scroll region, rows top to bottom
+  int bottom;
+  bool cursor_visible;
+  bool synchronized;
+  unsigned char attribute;
+  long long torn;               // frames that could be shown half drawn
+
+  char pending[4];              // bytes of a multibyte char received so far
+  int pending_length;
+  int state;
+  int params[16];
+  int param_count;
+  char prefix;                  // '?' of private modes
+  char intermediate;
+  long long unknown;            // sequences the model does not know
+} vt;
+
+// Blank the cells from y/x to y/x + length
+void vt_erase(vt *t, int y, int x, int length) {
+  for (int i = 0; i < length; i++) t->chars[y * t->columns + x + i] = ' ';
+  memset(t->attributes + y * t->columns + x, CELL_NORMAL, length);
+}
+
+// Blank the other half of the wide char at y/x, if any, as a terminal does
+// when half of a wide char is written over or erased
+void vt_split(vt *t, int y, int x) {
+  uint32_t *chars = t->chars + y * t->columns;
+
+  if (chars[x] == CELL_WIDE && x > 0) chars[x - 1] = ' ';
+  if (chars[x] != CELL_WIDE && x + 1 < t->columns &&
+      chars[x + 1] == CELL_WIDE) {
+    chars[x + 1] = ' ';
+  }
+}
+
+void vt_init(vt *t, int rows, int columns) {
+  memset(t, 0, sizeof(*t));
+  t->rows = rows;
+  t->columns = columns;
+  t->chars = malloc(rows * columns * sizeof(*t->chars));
+  t->attributes = malloc(rows * columns);
+  if (t->chars == NULL || t->attributes == NULL) exit(1);
+  t->cursor_visible = true;
+  t->bottom = rows - 1;
+  vt_erase(t, 0, 0, rows * columns);
+}
+
+void vt_destroy(vt *t) {
+  free(t->chars);
+  free(t->attributes);
+}
+
+// Move the rows of the scroll region up by count (down when negative), the
+// rows exposed are blank
+void vt_scroll(vt *t, int count) {
+  int height = t->bottom - t->top + 1, n = abs(count), columns = t->columns;
+  uint32_t *chars = t->chars + t->top * columns;
+  unsigned char *attributes = t->attributes + t->top * columns;
+
+  if (n > height) n = height;
+  if (count > 0) {
+    memmove(chars, chars + n * columns, 
+            (height - n) * columns * sizeof(*chars));
+    memmove(attributes, attributes + n * columns, (height - n) * columns);
+    vt_erase(t, t->bottom - n + 1, 0, n * columns);
+  } else {
+    memmove(chars + n * columns, chars, 
+            (height - n) * columns * sizeof(*chars));
+    memmove(attributes + n * columns, attributes, (height - n) * columns);
+    vt_erase(t, t->top, 0, n * columns);
+  }
+}
+
+int vt_param(vt *t, int i, int otherwise) {
+  return i < t->param_count && t->params[i] ? t->params[i] : otherwise;
+}
+
+void vt_clamp(vt *t) {
+  if (t->y < 0) t->y = 0;
+  if (t->y >= t->rows) t->y = t->rows - 1;
+  if (t->x < 0) t->x = 0;
+  if (t->x > t->columns) t->x = t->columns;
+}
+
+void vt_csi(vt *t, char final) {
+  switch (final) {
+  case 'H':
+  case 'f':
+    t->y = vt_param(t, 0, 1) - 1;
+    t->x = vt_param(t, 1, 1) - 1;
+    break;
+  case 'A': t->y -= vt_param(t, 0, 1); break;
+  case 'B': t->y += vt_param(t, 0, 1); break;
+  case 'C': t->x += vt_param(t, 0, 1); break;
+  case 'D': t->x -= vt_param(t, 0, 1); break;
+  case 'K':
+    if (vt_param(t, 0, 0) != 0 || t->x >= t->columns) break;
+    vt_split(t, t->y, t->x);
+    vt_erase(t, t->y, t->x, t->columns - t->x);
+    break;
+  case 'J':
+    if (vt_param(t, 0, 0) == 2) vt_erase(t, 0, 0, t->rows * t->columns);
+    else t->unknown++;
+    break;
+  case 'r':
+    t->top = vt_param(t, 0, 1) - 1;
+    t->bottom = vt_param(t, 1, t->rows) - 1;
+    if (t->top < 0 || t->bottom >= t->rows || t->top >= t->bottom) {
+      t->top = 0;
+      t->bottom = t->rows - 1;
+      t->unknown++;
+    }
+    t->y = t->x = 0;
+    break;
+  case 'S': vt_scroll(t, vt_param(t, 0, 1)); break;
+  case 'T': vt_scroll(t, -vt_param(t, 0, 1)); break;
+  case 'm':
+    for (int i = 0; i < (t->param_count ? t->param_count : 1); i++) {
+      switch (vt_param(t, i, 0)) {
+      case 0: case 27: t->attribute = CELL_NORMAL; break;
+      case 7: t->attribute = CELL_REVERSE; break;
+      case 39: break;
+      default: t->unknown++;
+      }
+    }
+    break;
+  case 'h':
+  case 'l':
+    if (t->prefix == '?' && vt_param(t, 0, 0) == 25) {
+      t->cursor_visible = final == 'h';
+    } else if (t->prefix == '?' && vt_param(t, 0, 0) == 2026) {
+      t->synchronized = final == 'h';
+    } else if (t->prefix != '?' || vt_param(t, 0, 0) != 2004) {
+      t->unknown++;
+    }
+    break;
+  default:
+    t->unknown++;
+  }
+  vt_clamp(t);
+}
+
+// Show the char of the bytes pending at the cursor. A combining char goes
+// with the char before the cursor when its bytes fit in the cell
+void vt_print(vt *t) {
+  uint32_t *chars = t->chars + t->y * t->columns, cell = 0, codepoint;
+  int width, n = t->pending_length, at = t->x;
+
+  t->pending_length = 0;
+  if (n > 1 && (utf8_decode(t->pending, n, &codepoint) != n || 
+                codepoint < 0xa0)) {
+    // not UTF-8 or a C1 control, cline never sends those
+    t->unknown++;
+    return;
+  }
+  for (int i = n - 1; i >= 0; i--) {
+    cell = cell << 8 | (unsigned char)t->pending[i];
+  }
+  width = n == 1 ? 1 : render_width(codepoint);
+  if (width == 0) {
+    int used;
+
+    if (--at >= 0 && chars[at] == CELL_WIDE) at--;
+    if (at < 0) return;
+    used = chars[at] > 0xffffff ? 4 : chars[at] > 0xffff ? 3 
+                                    : chars[at] > 0xff ? 2 : 1;
+    if (used + n <= 4) chars[at] |= cell << (8 * used);
+    return;
+  }
+  if (at + width > t->columns) {
+    // would wrap, cline never writes past the margin
+    t->unknown++;
+    return;
+  }
+  for (int i = 0; i < width; i++) vt_split(t, t->y, at + i);
+  chars[at] = cell;
+  t->attributes[t->y * t->columns + at] = t->attribute;
+  if (width == 2) {
+    chars[at + 1] = CELL_WIDE;
+    t->attributes[t->y * t->columns + at + 1] = t->attribute;
+  }
+  t->x += width;
+}
+
+void vt_feed(vt *t, const char *s, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    unsigned char c = s[i];
+
+    switch (t->state) {
+    case VT_GROUND:
+      if (t->pending_length > 0 && (c & 0xc0) == 0x80) {
+        int n = (t->pending[0] & 0xe0) == 0xc0 ? 2 
+              : (t->pending[0] & 0xf0) == 0xe0 ? 3 : 4;
+
+        t->pending[t->pending_length++] = c;
+        if (t->pending_length == n) vt_print(t);
+        break;
+      }
+      if (t->pending_length > 0) {
+        // a multibyte char cut short
+        t->pending_length = 0;
+        t->unknown++;
+      }
+      if (c == ESC) {
+        t->state = VT_ESCAPE;
+      } else if (c == '\r') {
+        t->x = 0;
+      } else if (c == '\n' || c == '\v' || c == '\f') {
+        if (t->y < t->rows - 1) t->y++;
+      } else if (c == '\b') {
+        if (t->x > 0) t->x--;
+      } else if (c == TAB) {
+        t->x = t->x + 8 - t->x % 8;
+        if (t->x > t->columns - 1) t->x = t->columns - 1;
+      } else if (c >= 0xc2 && c <= 0xf4) {
+        t->pending[0] = c;
+        t->pending_length = 1;
+      } else if (c >= 0x80) {
+        t->unknown++;
+      } else if (c >= ' ' && c != 0x7f) {
+        t->pending[0] = c;
+        t->pending_length = 1;
+        vt_print(t);
+      }
+      break;
+    case VT_ESCAPE:
+      if (c == '[') {
+        t->state = VT_CSI;
+        t->param_count = 0;
+        t->prefix = t->intermediate = 0;
+        memset(t->params, 0, sizeof(t->params));
+      } else {
+        t->unknown++;
+        t->state = VT_GROUND;
+      }
+      break;
+    case VT_CSI:
+      if (c >= '0' && c <= '9') {
+        if (t->param_count == 0) t->param_count = 1;
+        t->params[t->param_count - 1] = t->params[t->param_count - 1] * 10 + 
+          c - '0';
+      } else if (c == ';') {
+        if (t->param_count == 0) t->param_count = 1;
+        if (t->param_count < 16) t->param_count++;
+      } else if (c >= '<' && c <= '?') {
+        t->prefix = c;
+      } else if (c >= ' ' && c <= '/') {
+        t->intermediate = c;
+      } else {
+        vt_csi(t, c);
+        t->state = VT_GROUND;
+      }
+      break;
+    }
+  }
+}
+
+// Print the cells of a row to stderr, the reversed ones between []
+void vt_print_row(const uint32_t *chars, const unsigned char *attributes,
+                  int columns) {
+  for (int x = 0; x < columns; x++) {
+    if (attributes[x] != (x ? attributes[x - 1] : CELL_NORMAL)) {
+      fputc(attributes[x] == CELL_REVERSE ? '[' : ']', stderr);
+    }
+    for (uint32_t cell = chars[x]; cell != 0; cell >>= 8) {
+      fputc(cell & 0xff, stderr);
+    }
+  }
+  if (attributes[columns - 1] == CELL_REVERSE) fputc(']', stderr);
+}
+
+// Compare the cells and the cursor of the model with what cline believes the
+// terminal shows. Prints the first difference and returns false on mismatch.
+bool vt_check(vt *t) {
+  screen *shown = &EDITOR.shown;
+
+  for (int y = 0; y < t->rows; y++) {
+    int at = y * t->columns;
+
+    if (memcmp(t->chars + at, shown->chars + at, 
+               t->columns * sizeof(*t->chars)) == 0 &&
+        memcmp(t->attributes + at, shown->attributes + at, t->columns) == 0) {
+      continue;
+    }
+    fprintf(stderr, "row %d differs\n  terminal: ", y + 1);
+    vt_print_row(t->chars + at, t->attributes + at, t->columns);
+    fprintf(stderr, "\n  cline:    ");
+    vt_print_row(shown->chars + at, shown->attributes + at, t->columns);
+    fprintf(stderr, "\n");
+    return false;
+  }
+  if (t->y + 1 != EDITOR.shown_cursor_y || t->x + 1 != EDITOR.shown_cursor_x) {
+    fprintf(stderr, "cursor at %d;%d, cline has it at %d;%d\n", t->y + 1, 
+            t->x + 1, EDITOR.shown_cursor_y, EDITOR.shown_cursor_x);
+    return false;
+  }
+  if (!t->cursor_visible || t->synchronized || t->unknown) {
+    fprintf(stderr, "cursor hidden, update not ended or unknown sequences "
+            "(%lld)\n", t->unknown);
+    return false;
+  }
+  return true;
+}
+
+// In-process rendering --------------------------------------------------------
+
+// Frames drawn by screen_refresh are captured in a temporary file standing
+// for the terminal, then fed to the model
+typedef struct capture {
+  FILE *terminal;
+  int stdout_fd;
+  char *output;
+  size_t capacity;
+} capture;
+
+// Draw a frame, returns its size and adds the time spent drawing and parsing
+size_t render_frame(capture *c, vt *t, long long *draw, long long *parse) {
+  long long start;
+  long length;
+  bool torn = false;
+
+  fflush(stdout);
+  dup2(fileno(c->terminal), STDOUT_FILENO);
+  start = stats_now();
+  screen_refresh();
+  *draw += stats_now() - start;
+  dup2(c->stdout_fd, STDOUT_FILENO);
+
+  length = lseek(fileno(c->terminal), 0, SEEK_CUR);
+  if (length <= 0) return 0;
+  if ((size_t)length > c->capacity) {
+    c->capacity = length;
+    if ((c->output = realloc(c->output, length)) == NULL) exit(1);
+  }
+  if (pread(fileno(c->terminal), c->output, length, 0) != length ||
+      ftruncate(fileno(c->terminal), 0) == -1) {
+    exit(1);
+  }
+  lseek(fileno(c->terminal), 0, SEEK_SET);
+
+  start = stats_now();
+  for (long fed = 0, n; fed < length; fed += n) {
+    n = length - fed < VT_READ_SIZE ? length - fed : VT_READ_SIZE;
+    vt_feed(t, c->output + fed, n);
+    if (fed + n < length && !t->synchronized) torn = true;
+  }
+  *parse += stats_now() - start;
+  t->torn += torn;
+  return length;
+}
+
+// Drive the editor in-process with a fixed script of keys, drawing and
+// checking a frame after each one, in incremental or whole-screen mode, as
+// synchronized updates or not. mode names the run
+void render_bench(const char *mode, const char *filename, bool full_redraw,
+                  bool synchronized) {
+  static const char typed[] = "(defun bench (x) (+ x 1))";
+  long long draw = 0, parse = 0, bytes = 0, allocations;
+  int frames = 0;
+  capture c = {0};
+  vt t;
+
+  editor_init();
+  EDITOR.full_redraw = full_redraw;
+  EDITOR.synchronized_output = synchronized;
+  EDITOR.screen_rows = BENCH_ROWS - 2;
+  EDITOR.screen_columns = BENCH_COLUMNS;
+  if (editor_open((char *)filename) == -1) {
+    perror("Unable to open the file");
+    exit(1);
+  }
+  // index the whole file. frames are drawn here, the loop must not schedule
+  // any
+  EDITOR.frame_scheduled = true;
+  while (INDEX.running) event_loop_once();
+  EDITOR.frame_scheduled = false;
+  vt_init(&t, BENCH_ROWS, BENCH_COLUMNS);
+  if ((c.terminal = tmpfile()) == NULL || (c.stdout_fd = dup(1)) == -1) exit(1);
+
+  allocations = STATS.allocations;
+  for (int i = 0; i < 2000; i++) {
+    int step = i % 1000;
+
+    if (i > 0) {
+      if (step < 300) {
+        editor_on_keypress(step % 40 == 39 ? ENTER : typed[step % 25]);
+      } else if (step < 400) {
+        editor_on_keypress(BACKSPACE);
+      } else if (step < 800) {
+        editor_on_keypress(ARROW_DOWN);
+      } else {
+        editor_on_keypress(step % 2 ? ARROW_UP : ARROW_LEFT);
+      }
+    }
+    bytes += render_frame(&c, &t, &draw, &parse);
+    frames++;
+    if (!vt_check(&t)) {
+      fprintf(stderr, "%s rendering: frame %d is wrong\n", mode, i);
+      exit(1);
+    }
+  }
+
+  printf("%-12s %4s %6d %10.0f %12.0f %10.1f %12.2f %6lld %10s\n", mode,
+         synchronized ? "yes" : "no", frames, frames / (draw / 1e6),
+         frames / (parse / 1e6), (double)bytes / frames, 
+         (double)(STATS.allocations - allocations) / frames, t.torn, "ok");
+
+  fclose(c.terminal);
+  close(c.stdout_fd);
+  free(c.output);
+  vt_destroy(&t);
+  journal_stop();
+}
+
+// Typing in the middle of a long line -----------------------------------------
+
+// Cost of a keystroke, drawing included, in the middle of a 100K line of
+// minified code made of unit, after head: the line is laid out from both
+// sides of the gap, TABs and multibyte chars included. name tells the line
+// in the report and in the name of its file
+void line_bench(const char *dir, const char *name, const char *head,
+                const char *unit) {
+  char filename[512];
+  long long draw = 0, parse = 0, keys = 0, start;
+  size_t unit_length = strlen(unit);
+  capture c = {0};
+  FILE *fp;
+  vt t;
+
+  snprintf(filename, sizeof(filename), "%s/bench-line%s%s.lisp", dir,
+           name[0] ? "-" : "", name);
+  if ((fp = fopen(filename, "w")) == NULL) exit(1);
+  fputs(head, fp);
+  for (size_t i = 0; i < 100 * 1024 / unit_length; i++) fputs(unit, fp);
+  fputs("\n", fp);
+  fclose(fp);
+
+  editor_init();
+  EDITOR.screen_rows = BENCH_ROWS - 2;
+  EDITOR.screen_columns = BENCH_COLUMNS;
+  if (editor_open(filename) == -1) exit(1);
+  vt_init(&t, BENCH_ROWS, BENCH_COLUMNS);
+  if ((c.terminal = tmpfile()) == NULL || (c.stdout_fd = dup(1)) == -1) exit(1);
+  editor_set_cursor(0, strlen(head) + 50 * 1024 / unit_length * unit_length);
+  render_frame(&c, &t, &draw, &parse);
+
+  draw = 0;
+  for (int i = 0; i < 2000; i++) {
+    start = stats_now();
+    editor_on_keypress(i % 4 == 3 ? BACKSPACE : 'a' + i % 26);
+    keys += stats_now() - start;
+    render_frame(&c, &t, &draw, &parse);
+  }
+  if (!vt_check(&t)) {
+    fprintf(stderr, "long line %s: the last frame is wrong\n", name);
+    exit(1);
+  }
+  printf("%slong line %-5s %8.2f us/key %8.2f us/frame\n", 
+         name[0] ? "" : "\n", name, keys / 2000.0, draw / 2000.0);
+
+  fclose(c.terminal);
+  close(c.stdout_fd);
+  free(c.output);
+  vt_destroy(&t);
+  journal_stop();
+}
+
+// Crash recovery --------------------------------------------------------------
+
+// Edit filename in-process with a long session of keys at random lines,
+// journaled as cline does, then open it again as after a crash: time the
+// replay and check it rebuilds the same text
+void recovery_bench(const char *filename) {
+  const int keys = 100000;
+  size_t length, offset, n, chunk = 1 << 20;
+  long long start, elapsed;
+  int row_count;
+  char *a, *b;
+  struct stat st;
+  text edited;
+
+  editor_init();
+  EDITOR.screen_rows = BENCH_ROWS - 2;
+  EDITOR.screen_columns = BENCH_COLUMNS;
+  if (editor_open((char *)filename) == -1) exit(1);
+  EDITOR.frame_scheduled = true;
+  while (INDEX.running) event_loop_once();
+  EDITOR.frame_scheduled = false;
+
+  srand(1);
+  for (int i = 0; i < keys; i++) {
+    if (i % 25 == 0) editor_set_cursor(rand() % EDITOR.row_count, 0);
+    if (i % 500 == 499) {
+      editor_on_keypress(CTRL_KEY('z'));
+    } else if (i % 1000 == 500) {
+      editor_on_keypress(CTRL_KEY('y'));
+    } else if (i % 7 == 6) {
+      editor_on_keypress(BACKSPACE);
+    } else {
+      editor_on_keypress(i % 40 == 39 ? ENTER : 'a' + i % 26);
+    }
+    // the journal timer, once a second of typing
+    if (i % 10 == 9) journal_flush();
+  }
+  journal_flush();
+  if (stat(JOURNAL.name, &st) == -1) exit(1);
+
+  // the edited text stays, its chars are in memory and the mapping
+  edited = EDITOR.text;
+  row_count = EDITOR.row_count;
+  text_init(&EDITOR.text, NULL, 0);
+  start = stats_now();
+  if (editor_open((char *)filename) == -1) exit(1);
+  elapsed = stats_now() - start;
+
+  length = text_length(&edited);
+  if (length != text_length(&EDITOR.text) || row_count != EDITOR.row_count ||
+      (a = malloc(chunk)) == NULL || (b = malloc(chunk)) == NULL) {
+    fprintf(stderr, "recovery: the text is not the one edited\n");
+    exit(1);
+  }
+  for (offset = 0; offset < length; offset += n) {
+    n = length - offset < chunk ? length - offset : chunk;
+    text_read(&edited, offset, n, a);
+    text_read(&EDITOR.text, offset, n, b);
+    if (memcmp(a, b, n) != 0) {
+      fprintf(stderr, "recovery: the text is not the one edited\n");
+      exit(1);
+    }
+  }
+  printf("\nrecovery     %d keys %10lld B journal %8.1f ms open %10s\n",
+         keys, (long long)st.st_size, elapsed / 1000.0, "ok");
+
+  free(a);
+  free(b);
+  text_destroy(&edited);
+  journal_stop();
+}
+
+// Input decoding --------------------------------------------------------------
+
+// Sequences terminals send, with the keys they decode to
+static const struct {
+  const char *bytes;
+  int key;
+} DECODE_KEYS[] = {
+  {"a", 'a'}, {"(", '('}, {"\r", ENTER}, {"\x7f", BACKSPACE},
+  {"\x1b[A", ARROW_UP}, {"\x1bOB", ARROW_DOWN},
+  {"\x1b[1;5C", ARROW_RIGHT | KEY_CTRL}, {"\x1b[1;2D", ARROW_LEFT | KEY_SHIFT},
+  {"\x1b[H", HOME_KEY}, {"\x1bOF", END_KEY}, {"\x1b[5~", PAGE_UP},
+  {"\x1b[6;3~", PAGE_DOWN | KEY_ALT}, {"\x1b[3~", DEL},
+  {"\x1b[2~", INSERT_KEY}, {"\x1bOP", F1}, {"\x1b[15~", F1 + 4},
+  {"\x1b[24;5~", F12 | KEY_CTRL}, {"\x1b[Z", TAB | KEY_SHIFT}, 
+  {"\x1bx", 'x' | KEY_ALT}, {"\x1b[<0;12;5M", MOUSE}, 
+  {"\x1b[<64;1;1m", MOUSE}, {"\x1b[115;5u", CTRL_KEY('s')},
+  {"\x1b[97;3u", 'a' | KEY_ALT}, {"\x1b[27u", ESC},
+  {"\x1b[13;2:1u", ENTER | KEY_SHIFT}, {"\x1b[99;5:3u", -1},
+  {"\x1b[?1u", -1}, {"\x1b[12;40R", -1}, {"\x1b[?2026;2$y", -1},
+  {"\x1b[?62;22c", -1}, {"\x1b[4294967299~", -1},
+  {"\x1b[99999999999999999999999999999999~", -1}
+};
+
+// Throughput of decoding paste-sized chunks of typing and of every kind of
+// sequence, checking the keys decoded on the way. The first round is fed in
+// reads of 1 to 16 bytes, cutting sequences anywhere, and is not timed
+void decode_bench(void) {
+  const int rounds = 2000;
+  static char chunk[60 * 1024];
+  static int keys[60 * 1024];
+  int expected = 0, decoded = 0, length = 0, split = 0;
+  int count = sizeof(DECODE_KEYS) / sizeof(DECODE_KEYS[0]);
+  long long start, elapsed = 0;
+
+  // the replies of the terminal change nothing and write nothing back
+  EDITOR.kitty_keyboard = EDITOR.synchronized_forced = true;
+
+  // typing, one sequence every 8 chars
+  for (int i = 0; length < (int)sizeof(chunk) - 16; i++) {
+    int n = strlen(DECODE_KEYS[i % count].bytes);
+
+    memcpy(chunk + length, DECODE_KEYS[i % count].bytes, n);
+    length += n;
+    if (DECODE_KEYS[i % count].key != -1) {
+      keys[expected++] = DECODE_KEYS[i % count].key;
+    }
+    memcpy(chunk + length, "(f x y)", 7);
+    length += 7;
+    for (int j = 0; j < 7; j++) keys[expected++] = "(f x y)"[j];
+  }
+
+  for (int round = 0; round < rounds; round++) {
+    int fed = 0;
+
+    INPUT.ring_head = INPUT.ring_tail = 0;
+    INPUT.key_head = INPUT.key_tail = 0;
+    decoded = 0;
+    start = stats_now();
+    while (fed < length) {
+      int n = round == 0 ? 1 + split++ % 16 : length - fed;
+
+      if (n > length - fed) n = length - fed;
+      memcpy(INPUT.ring + INPUT.ring_head, chunk + fed, n);
+      INPUT.ring_head += n;
+      fed += n;
+      // until what is left is the start of a sequence
+      for (unsigned int tail = -1; INPUT.ring_tail != tail; ) {
+        tail = INPUT.ring_tail;
+        input_decode(false);
+        while (INPUT.key_tail != INPUT.key_head) {
+          int key = INPUT.keys[INPUT.key_tail++ & (INPUT_QUEUE_SIZE - 1)];
+
+          if (decoded >= expected || key != keys[decoded]) {
+            fprintf(stderr, "decoding: key %d is %d, not %d\n", decoded, key,
+                    decoded < expected ? keys[decoded] : -1);
+            exit(1);
+          }
+          decoded++;
+        }
+      }
+    }
+    if (round > 0) elapsed += stats_now() - start;
+  }
+  if (decoded != expected) {
+    fprintf(stderr, "decoding: %d keys of %d\n", decoded, expected);
+    exit(1);
+  }
+  EDITOR.kitty_keyboard = EDITOR.synchronized_forced = false;
+  printf("\ndecoding     %8.0f MB/s %8.1f Mkeys/s %10s\n",
+         (double)length * (rounds - 1) / elapsed,
+         (double)expected * (rounds - 1) / elapsed, "ok");
+}
+
+// Scanning kernels ------------------------------------------------------------
+
+// Throughput in MB/s of every scanning kernel the CPU supports: counting the
+// newlines of a file, and scanning it whole for a TAB or a non-ASCII char
+// that is not there, the case of plain rows
+void kernel_bench(const char *filename) {
+  const int rounds = 64;
+  struct stat st;
+  char *chars;
+  FILE *fp;
+
+  if (stat(filename, &st) == -1 || (chars = malloc(st.st_size)) == NULL ||
+      (fp = fopen(filename, "r")) == NULL) {
+    exit(1);
+  }
+  if (fread(chars, 1, st.st_size, fp) != (size_t)st.st_size) exit(1);
+  fclose(fp);
+  // no TAB and no non-ASCII char left
+  for (off_t i = 0; i < st.st_size; i++) {
+    if (chars[i] == TAB || chars[i] & 0x80) chars[i] = ' ';
+  }
+
+  printf("\n%-12s %12s %12s %12s\n", "kernel", "count \\n", "find TAB", 
+         "non-ASCII");
+  for (int k = 0; k < SCAN_KERNEL_COUNT; k++) {
+    const scan_kernel *kernel = &SCAN_KERNELS[k];
+    long long start, elapsed[3];
+    size_t found = 0;
+
+    if (!kernel->supported()) continue;
+    start = stats_now();
+    for (int i = 0; i < rounds; i++) {
+      found += kernel->count(chars, st.st_size, '\n');
+    }
+    elapsed[0] = stats_now() - start;
+    start = stats_now();
+    for (int i = 0; i < rounds; i++) {
+      found += kernel->find(chars, st.st_size, TAB) != NULL;
+    }
+    elapsed[1] = stats_now() - start;
+    start = stats_now();
+    for (int i = 0; i < rounds; i++) {
+      found += kernel->find_non_ascii(chars, st.st_size) != NULL;
+    }
+    elapsed[2] = stats_now() - start;
+
+    // found keeps the scans from being optimized away
+    printf("%-12s", found ? kernel->name : "");
+    for (int i = 0; i < 3; i++) {
+      printf(" %12.0f", (double)st.st_size * rounds / elapsed[i]);
+    }
+    printf("\n");
+  }
+  free(chars);
+}
+
+int main(void) {
+  const char *dir = getenv("BENCH_DIR") ? getenv("BENCH_DIR") : "/tmp/cline-bench";
+  char *sizes = strdup(getenv("BENCH_SIZES") ? getenv("BENCH_SIZES") 
+                                             : BENCH_DEFAULT_SIZES);
+  char filename[512], crlf[512], last[512] = "";
+
+  // measure the frames themselves, not the wait for the next frame tick,
+  // unless asked to
+  setenv("CLINE_FRAME_MS", "0", 0);
+  setvbuf(stdout, NULL, _IOLBF, 0);
+  mkdir(dir, 0755);
+  printf("%-10s %-8s %6s %9s %9s %9s %9s %10s %9s\n", "file", "trace", 
+         "frames", "p50 ms", "p90 ms", "p99 ms", "max ms", "B/frame", "RSS KB");
+
+  for (char *size = strtok(sizes, ","); size; size = strtok(NULL, ",")) {
+    snprintf(filename, sizeof(filename), "%s/bench-%s.lisp", dir, size);
+    if (bench_generate(filename, bench_parse_size(size), false) == -1) {
+      perror("Unable to generate the benchmark file");
+      return 1;
+    }
+    bench_file(size, filename);
+    strcpy(last, filename);
+  }
+  free(sizes);
+
+  snprintf(filename, sizeof(filename), "%s/bench-1M.lisp", dir);
+  snprintf(crlf, sizeof(crlf), "%s/bench-1M-crlf.lisp", dir);
+  if (bench_generate(filename, 1 << 20, false) == -1 ||
+      bench_generate(crlf, 1 << 20, true) == -1) {
+    perror("Unable to generate the benchmark file");
+    return 1;
+  }
+  printf("\n%-12s %4s %6s %10s %12s %10s %12s %6s %10s\n", "rendering",
+         "sync", "frames", "draw fps", "terminal fps", "B/frame", 
+         "allocs/frame", "torn", "vt check");
+  render_bench("incremental", filename, false, false);
+  render_bench("whole-screen", filename, true, false);
+  render_bench("incremental", filename, false, true);
+  render_bench("whole-screen", filename, true, true);
+  render_bench("CRLF", crlf, false, false);
+  line_bench(dir, "", "", "(f (g x) (h y))");
+  line_bench(dir, "tab", "\t", "(f (g x) (h y))");
+  line_bench(dir, "utf8", "", "(f (g \xc3\xa9) (h \xe5\xad\x97))");
+  kernel_bench(filename);
+  decode_bench();
+  if (last[0]) recovery_bench(last);
+  return 0;
+}
@@ -1,383 +1,3928 @@
 #define CLINE_VERSION "0.0.1"
 
+#define _DEFAULT_SOURCE
+
 #include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
 #include <signal.h>
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
 
+// A row is a view of one line of the text. chars points straight into the
+// text storage when the line lies inside a single piece, otherwise into a
+// private copy owned by the row: inside the row itself for short lines, in a
+// slab payload of copy_capacity bytes for the others, kept with its capacity
+// to be reused by the next fetch. Rows are laid out on the screen straight
+// from chars, see screen_put_text, from the column of the rendering of the
+// first char shown, kept in start. Each fetch gets a new generation and
+// forgets start. A row fits in a cache line.
+#define ROW_INLINE_SIZE 24
+
+// Where a char of a line is in the rendering, TABs expanded and multibyte
+// chars taking their width: kept to carry on from there
+typedef struct layout {
+  int offset;                           // char of the line, -1 for none
+  int column;                           // its column in the rendering
+} layout;
+
 typedef struct row {
-  int index;
+  const char *chars;
+  union {
+    char *payload;                      // when copy_capacity is not 0
+    char small[ROW_INLINE_SIZE];
+  } copy;
+  uint32_t copy_capacity;
+  int index;                            // line held, -1 for none
   int size;
-  int rendered_size;
-  char *chars;
-  char *rendered_chars;
+  uint32_t generation;
+  layout start;
 } row;
 
+// The text is stored in a piece table: the text is the in-order concatenation
+// of pieces, each of them pointing either into the original buffer or into
+// the append-only buffer that receives every insertion. Pieces live in a treap
+// ordered by position where each node caches the length and the newline count
+// of its subtree, so offset/line lookups and edits are O(log n).
+#define TEXT_PIECE_MAX (16 * 1024)    // bounds the scans inside a piece
+#define TEXT_BLOCK_SIZE (64 * 1024)   // allocation unit of the append buffer
+
+typedef struct piece {
+  struct piece *left;
+  struct piece *right;
+  unsigned int priority;
+
+  const char *chars;
+  size_t length;
+  size_t newlines;
+
+  size_t subtree_length;
+  size_t subtree_newlines;
+} piece;
+
+typedef struct text {
+  piece *root;
+
+  // the file mapped read-only, unmapped with the text, or NULL
+  char *mapping;
+  size_t mapping_length;
+
+  // append buffer, split in blocks so pieces and rows never see it move
+  char **blocks;
+  int block_count;
+  size_t block_used;
+} text;
+
+// The screen as a grid of cells, one per column, each holding a char and an
+// attribute. A char is the UTF-8 bytes shown in the column packed, the first
+// in the lowest byte, so ASCII chars are themselves. The column on the right
+// of a wide char holds CELL_WIDE.
+#define CELL_WIDE 0
+
+enum CELL_ATTRIBUTES {
+  CELL_NORMAL = 0,
+  CELL_REVERSE
+};
+
+typedef struct screen {
+  int rows;
+  int columns;
+  uint32_t *chars;
+  unsigned char *attributes;
+} screen;
+
 struct editor {
   int cursor_x;
   int cursor_y;
 
-  row *rows;
+  text text;
   int row_count;
+
+  // rows of the lines shown, direct mapped on the line index
+  row *rows;
+  int row_cache_size;
+  uint32_t row_generation;      // of the last row fetched
+  // the cursor in the rendering of the row of generation cursor_generation
+  layout cursor_layout;
+  uint32_t cursor_generation;
   int row_offset;
   int column_offset;
   
   int screen_rows;
   int screen_columns;
 
+  // the frame being composed and the one the terminal currently shows
+  screen frame;
+  screen shown;
+  bool shown_valid;
+  int shown_cursor_x;
+  int shown_cursor_y;
+  int shown_row_offset;
+  int frame_bytes;              // written by the last screen_refresh
+  bool full_redraw;             // repaint every row, for comparisons
+  bool synchronized_output;     // frames are DEC mode 2026 updates
+  bool synchronized_forced;     // by CLINE_SYNC_OUTPUT, the terminal is not asked
+  bool size_unknown;            // to the kernel, the terminal is asked
+  bool kitty_keyboard;          // keys come in the kitty protocol
+
+  // frames are scheduled: at most one per frame_interval ms
+  int frame_interval;
+  bool frame_scheduled;
+  long long last_frame;
+  bool size_changed;
+
   bool terminal_raw_mode;
 
   bool dirty;
   char *filename;
 
   char status_message[80];
+
+  // line number typed after Ctrl-G, keys go to it while prompting
+  bool prompting;
+  char prompt[16];
+  int prompt_length;
 };
 
 static struct editor EDITOR;
 
+// Instrumentation: counters for the debug overlay (toggled with Ctrl-T) and a
+// trace of the hot paths in Chrome trace-event format, written to the file
+// named by CLINE_TRACE. Allocations go through the stats_ wrappers to be
+// counted.
+typedef struct stats {
+  bool overlay;
+  FILE *trace;
+
+  // running totals
+  long long allocations;
+  long long reads;              // read() calls on the terminal
+  long long keys;               // keys decoded
+  long long input_time;         // when input not yet on screen came, or 0
+
+  // last frame
+  long long render_time;
+  long long latency;            // from input to the end of the frame write
+  long long frame_reads;
+  long long frame_keys;
+  long long frame_allocations;
+} stats;
+
+static stats STATS;
+
+void *stats_malloc(size_t size) {
+  STATS.allocations++;
+  return malloc(size);
+}
+
+void *stats_calloc(size_t count, size_t size) {
+  STATS.allocations++;
+  return calloc(count, size);
+}
+
+void *stats_realloc(void *p, size_t size) {
+  STATS.allocations++;
+  return realloc(p, size);
+}
+
+// Monotonic clock in microseconds, timers keep their deadlines in ms of it
+long long stats_now(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void stats_trace_open(const char *filename) {
+  if ((STATS.trace = fopen(filename, "w")) == NULL) return;
+  fputs("[\n", STATS.trace);
+}
+
+void stats_trace_close(void) {
+  if (STATS.trace == NULL) return;
+  fputs("{}]\n", STATS.trace);
+  fclose(STATS.trace);
+  STATS.trace = NULL;
+}
+
+// Record a complete event, start and duration in microseconds, with one
+// integer argument
+void stats_trace(const char *name, long long start, long long duration,
+                 const char *arg, long long value) {
+  if (STATS.trace == NULL) return;
+  fprintf(STATS.trace, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,"
+          "\"ts\":%lld,\"dur\":%lld,\"args\":{\"%s\":%lld}},\n",
+          name, start, duration, arg, value);
+}
+
+#define CTRL_KEY(k) ((k) & 0x1f)
+
 enum KEY_CODES {
   TAB = 9,
   ENTER = 13,
   ESC = 27,
   BACKSPACE = 127,
 
-  // The following are just soft codes, not really reported by the 
-  // terminal directly
-  ARROW_LEFT = 1000,
-  ARROW_RIGHT,
-  ARROW_UP,
-  ARROW_DOWN,
-  DEL
-};
+  // The following are just soft codes, not really reported by the 
+  // terminal directly
+  ARROW_LEFT = 1000,
+  ARROW_RIGHT,
+  ARROW_UP,
+  ARROW_DOWN,
+  DEL,
+  HOME_KEY,
+  END_KEY,
+  PAGE_UP,
+  PAGE_DOWN,
+  INSERT_KEY,
+  F1,
+  F12 = F1 + 11,
+  MOUSE,                        // a mouse report, see INPUT.mouse_button
+  CURSOR_POSITION,              // a position report, see INPUT.position_row
+  PASTE                         // a bracketed paste, its text is INPUT.paste
+};
+
+// Bits set on keys pressed with modifiers
+enum KEY_MODIFIERS {
+  KEY_SHIFT = 1 << 16,
+  KEY_ALT = 1 << 17,
+  KEY_CTRL = 1 << 18,
+  KEY_MODIFIERS = KEY_SHIFT | KEY_ALT | KEY_CTRL
+};
+
+// Scanning kernels ------------------------------------------------------------
+
+// The byte scans of the hot paths, newline counting of the index and finding
+// TABs and non-ASCII chars in rows, have vector versions picked at startup by
+// scan_init from what the CPU supports. SSE2 is part of x86-64, AVX2 is not.
+typedef struct scan_kernel {
+  const char *name;
+  bool (*supported)(void);
+  size_t (*count)(const char *s, size_t length, char c);
+  const char *(*find)(const char *s, size_t length, char c);
+  const char *(*find_non_ascii)(const char *s, size_t length);
+} scan_kernel;
+
+bool scan_always(void) {
+  return true;
+}
+
+size_t scan_count_scalar(const char *s, size_t length, char c) {
+  size_t count = 0;
+
+  for (size_t i = 0; i < length; i++) count += s[i] == c;
+  return count;
+}
+
+const char *scan_find_scalar(const char *s, size_t length, char c) {
+  return memchr(s, c, length);
+}
+
+const char *scan_find_non_ascii_scalar(const char *s, size_t length) {
+  for (size_t i = 0; i < length; i++) {
+    if (s[i] & 0x80) return s + i;
+  }
+  return NULL;
+}
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#include <immintrin.h>
+
+// Matches are counted in byte lanes (a match is -1, subtracted), summed up
+// before a lane can overflow
+size_t scan_count_sse2(const char *s, size_t length, char c) {
+  __m128i needle = _mm_set1_epi8(c), zero = _mm_setzero_si128();
+  size_t count = 0, i = 0;
+
+  while (i + 16 <= length) {
+    __m128i lanes = zero, sums;
+
+    for (int n = 0; n < 255 && i + 16 <= length; n++, i += 16) {
+      __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+      lanes = _mm_sub_epi8(lanes, _mm_cmpeq_epi8(chunk, needle));
+    }
+    sums = _mm_sad_epu8(lanes, zero);
+    count += _mm_cvtsi128_si64(sums) + 
+      _mm_cvtsi128_si64(_mm_unpackhi_epi64(sums, sums));
+  }
+  return count + scan_count_scalar(s + i, length - i, c);
+}
+
+const char *scan_find_sse2(const char *s, size_t length, char c) {
+  __m128i needle = _mm_set1_epi8(c);
+  size_t i = 0;
+
+  for (; i + 16 <= length; i += 16) {
+    __m128i chunk = _mm_loadu_si128((const __m128i *)(s + i));
+    int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, needle));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return scan_find_scalar(s + i, length - i, c);
+}
+
+const char *scan_find_non_ascii_sse2(const char *s, size_t length) {
+  size_t i = 0;
+
+  for (; i + 16 <= length; i += 16) {
+    int mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i *)(s + i)));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return scan_find_non_ascii_scalar(s + i, length - i);
+}
+
+bool scan_avx2_supported(void) {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+size_t scan_count_avx2(const char *s, size_t length, char c) {
+  __m256i needle = _mm256_set1_epi8(c), zero = _mm256_setzero_si256();
+  size_t count = 0, i = 0;
+
+  while (i + 32 <= length) {
+    __m256i lanes = zero, sums;
+
+    for (int n = 0; n < 255 && i + 32 <= length; n++, i += 32) {
+      __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+      lanes = _mm256_sub_epi8(lanes, _mm256_cmpeq_epi8(chunk, needle));
+    }
+    sums = _mm256_sad_epu8(lanes, zero);
+    count += _mm256_extract_epi64(sums, 0) + _mm256_extract_epi64(sums, 1) +
+      _mm256_extract_epi64(sums, 2) + _mm256_extract_epi64(sums, 3);
+  }
+  return count + scan_count_sse2(s + i, length - i, c);
+}
+
+__attribute__((target("avx2")))
+const char *scan_find_avx2(const char *s, size_t length, char c) {
+  __m256i needle = _mm256_set1_epi8(c);
+  size_t i = 0;
+
+  // two vectors per round, the loop is bound by the loads
+  for (; i + 64 <= length; i += 64) {
+    __m256i a = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *)(s + i)), needle);
+    __m256i b = _mm256_cmpeq_epi8(
+      _mm256_loadu_si256((const __m256i *)(s + i + 32)), needle);
+    if (_mm256_movemask_epi8(_mm256_or_si256(a, b)) == 0) continue;
+    break;
+  }
+  for (; i + 32 <= length; i += 32) {
+    __m256i chunk = _mm256_loadu_si256((const __m256i *)(s + i));
+    unsigned int mask = 
+      _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, needle));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return scan_find_sse2(s + i, length - i, c);
+}
+
+__attribute__((target("avx2")))
+const char *scan_find_non_ascii_avx2(const char *s, size_t length) {
+  size_t i = 0;
+
+  for (; i + 64 <= length; i += 64) {
+    __m256i a = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i b = _mm256_loadu_si256((const __m256i *)(s + i + 32));
+    if (_mm256_movemask_epi8(_mm256_or_si256(a, b)) == 0) continue;
+    break;
+  }
+  for (; i + 32 <= length; i += 32) {
+    unsigned int mask = 
+      _mm256_movemask_epi8(_mm256_loadu_si256((const __m256i *)(s + i)));
+    if (mask) return s + i + __builtin_ctz(mask);
+  }
+  return scan_find_non_ascii_sse2(s + i, length - i);
+}
+#endif
+
+// In order of preference
+static const scan_kernel SCAN_KERNELS[] = {
+#if defined(__x86_64__) && defined(__GNUC__)
+  {"avx2", scan_avx2_supported, scan_count_avx2, scan_find_avx2,
+   scan_find_non_ascii_avx2},
+  {"sse2", scan_always, scan_count_sse2, scan_find_sse2,
+   scan_find_non_ascii_sse2},
+#endif
+  {"scalar", scan_always, scan_count_scalar, scan_find_scalar,
+   scan_find_non_ascii_scalar}
+};
+
+#define SCAN_KERNEL_COUNT (int)(sizeof(SCAN_KERNELS) / sizeof(SCAN_KERNELS[0]))
+
+static const scan_kernel *SCAN = &SCAN_KERNELS[SCAN_KERNEL_COUNT - 1];
+
+// Pick the best kernels, CLINE_SCAN names others (e.g. "scalar")
+void scan_init(void) {
+  const char *name = getenv("CLINE_SCAN");
+
+  for (int i = 0; i < SCAN_KERNEL_COUNT; i++) {
+    if (!SCAN_KERNELS[i].supported()) continue;
+    if (name && strcmp(name, SCAN_KERNELS[i].name) != 0) continue;
+    SCAN = &SCAN_KERNELS[i];
+    return;
+  }
+}
+
+// Piece table -----------------------------------------------------------------
+
+size_t text_count_newlines(const char *s, size_t length) {
+  return SCAN->count(s, length, '\n');
+}
+
+unsigned int piece_random(void) {
+  static unsigned int state = 2463534242u;
+
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+// New piece of length chars holding newlines '\n'
+piece *piece_new_counted(const char *chars, size_t length, size_t newlines) {
+  piece *p = stats_malloc(sizeof(piece));
+
+  if (p == NULL) return NULL;
+  p->left = p->right = NULL;
+  p->priority = piece_random();
+  p->chars = chars;
+  p->length = length;
+  p->newlines = newlines;
+  p->subtree_length = length;
+  p->subtree_newlines = newlines;
+  return p;
+}
+
+piece *piece_new(const char *chars, size_t length) {
+  return piece_new_counted(chars, length, text_count_newlines(chars, length));
+}
+
+void piece_update(piece *p) {
+  p->subtree_length = p->length;
+  p->subtree_newlines = p->newlines;
+  if (p->left) {
+    p->subtree_length += p->left->subtree_length;
+    p->subtree_newlines += p->left->subtree_newlines;
+  }
+  if (p->right) {
+    p->subtree_length += p->right->subtree_length;
+    p->subtree_newlines += p->right->subtree_newlines;
+  }
+}
+
+void piece_free(piece *p) {
+  if (p == NULL) return;
+  piece_free(p->left);
+  piece_free(p->right);
+  free(p);
+}
+
+// Concatenate two treaps, every position of a preceding every position of b
+piece *piece_merge(piece *a, piece *b) {
+  if (a == NULL) return b;
+  if (b == NULL) return a;
+  if (a->priority >= b->priority) {
+    a->right = piece_merge(a->right, b);
+    piece_update(a);
+    return a;
+  }
+  b->left = piece_merge(a, b->left);
+  piece_update(b);
+  return b;
+}
+
+// Split a treap in the chars before offset (*left) and the ones from offset on
+// (*right). A piece straddling offset is cut in two. When the new piece cannot
+// be allocated, false is returned and the split is made before that piece
+// instead: merging *left and *right back gives the treap unchanged.
+bool piece_split(piece *p, size_t offset, piece **left, piece **right) {
+  size_t left_length;
+  bool split;
+
+  if (p == NULL) {
+    *left = *right = NULL;
+    return true;
+  }
+
+  left_length = p->left ? p->left->subtree_length : 0;
+  if (offset <= left_length) {
+    split = piece_split(p->left, offset, left, &p->left);
+    piece_update(p);
+    *right = p;
+  } else if (offset >= left_length + p->length) {
+    offset -= left_length + p->length;
+    split = piece_split(p->right, offset, &p->right, right);
+    piece_update(p);
+    *left = p;
+  } else {
+    size_t cut = offset - left_length;
+    piece *tail = piece_new(p->chars + cut, p->length - cut);
+
+    if (tail == NULL) {
+      *left = p->left;
+      p->left = NULL;
+      piece_update(p);
+      *right = p;
+      return false;
+    }
+    // the tail takes over the right subtree, keep the heap order with it
+    tail->priority = p->priority;
+    tail->right = p->right;
+    piece_update(tail);
+
+    p->length = cut;
+    p->newlines -= tail->newlines;
+    p->right = NULL;
+    piece_update(p);
+
+    *left = p;
+    *right = tail;
+    split = true;
+  }
+  return split;
+}
+
+// Grow the last piece of p when chars directly follow it in memory, which is
+// the common case of typing: consecutive insertions land back to back in the
+// append buffer. Returns false when a new piece is needed.
+bool piece_extend(piece *p, const char *chars, size_t length) {
+  if (p == NULL) return false;
+  if (p->right) {
+    if (!piece_extend(p->right, chars, length)) return false;
+  } else {
+    if (p->chars + p->length != chars) return false;
+    if (p->length + length > TEXT_PIECE_MAX) return false;
+    p->length += length;
+    p->newlines += text_count_newlines(chars, length);
+  }
+  piece_update(p);
+  return true;
+}
+
+// Copy length chars starting at offset of the subtree p into dest
+void piece_read(piece *p, size_t offset, size_t length, char *dest) {
+  while (p && length > 0) {
+    size_t left_length = p->left ? p->left->subtree_length : 0;
+    size_t n;
+
+    if (offset < left_length) {
+      n = left_length - offset < length ? left_length - offset : length;
+      piece_read(p->left, offset, n, dest);
+      dest += n;
+      offset += n;
+      length -= n;
+      continue;
+    }
+    offset -= left_length;
+    if (offset < p->length) {
+      n = p->length - offset < length ? p->length - offset : length;
+      memcpy(dest, p->chars + offset, n);
+      dest += n;
+      offset += n;
+      length -= n;
+    }
+    offset -= p->length;
+    p = p->right;
+  }
+}
+
+// Call visit on the chars of p from offset to offset + length, in order, as
+// they are stored
+void piece_spans(piece *p, size_t offset, size_t length,
+                 void (*visit)(const char *chars, size_t length)) {
+  while (p && length > 0) {
+    size_t left_length = p->left ? p->left->subtree_length : 0;
+    size_t n;
+
+    if (offset < left_length) {
+      n = left_length - offset < length ? left_length - offset : length;
+      piece_spans(p->left, offset, n, visit);
+      offset += n;
+      length -= n;
+      continue;
+    }
+    offset -= left_length;
+    if (offset < p->length) {
+      n = p->length - offset < length ? p->length - offset : length;
+      visit(p->chars + offset, n);
+      offset += n;
+      length -= n;
+    }
+    offset -= p->length;
+    p = p->right;
+  }
+}
+
+// Length of the piece to cut at the start of the length chars of s. The
+// original buffer is cut in bounded pieces so that no scan inside a piece
+// depends on the size of the file. cuts are made after a newline when there
+// is one, so that lines do not straddle pieces and rows need no copy
+size_t text_piece_length(const char *s, size_t length) {
+  size_t n = length < TEXT_PIECE_MAX ? length : TEXT_PIECE_MAX;
+
+  if (n < length) {
+    size_t cut = n;
+    while (cut > 0 && s[cut - 1] != '\n') cut--;
+    if (cut > 0) n = cut;
+  }
+  return n;
+}
+
+void text_init(text *t, const char *original, size_t length) {
+  t->root = NULL;
+  t->mapping = NULL;
+  t->mapping_length = 0;
+  t->blocks = NULL;
+  t->block_count = 0;
+  t->block_used = 0;
+
+  for (size_t offset = 0, n; offset < length; offset += n) {
+    n = text_piece_length(original + offset, length - offset);
+    t->root = piece_merge(t->root, piece_new(original + offset, n));
+  }
+}
+
+void text_destroy(text *t) {
+  piece_free(t->root);
+  for (int i = 0; i < t->block_count; i++) free(t->blocks[i]);
+  free(t->blocks);
+  if (t->mapping) munmap(t->mapping, t->mapping_length);
+  t->root = NULL;
+  t->mapping = NULL;
+  t->blocks = NULL;
+  t->block_count = 0;
+}
+
+size_t text_length(text *t) {
+  return t->root ? t->root->subtree_length : 0;
+}
+
+// Number of lines: the text is a sequence of lines separated by '\n'
+size_t text_line_count(text *t) {
+  if (t->root == NULL || t->root->subtree_length == 0) return 0;
+  return t->root->subtree_newlines + 1;
+}
+
+// Copy as much of s as fits in the current block of the append buffer and
+// return where it was stored, *stored gets the amount copied
+const char *text_append(text *t, const char *s, size_t length, size_t *stored) {
+  char *block;
+
+  if (t->block_count == 0 || t->block_used == TEXT_BLOCK_SIZE) {
+    char **blocks = 
+      stats_realloc(t->blocks, sizeof(char *) * (t->block_count + 1));
+
+    if (blocks == NULL) return NULL;
+    t->blocks = blocks;
+    if ((t->blocks[t->block_count] = stats_malloc(TEXT_BLOCK_SIZE)) == NULL) {
+      return NULL;
+    }
+    t->block_count++;
+    t->block_used = 0;
+  }
+
+  block = t->blocks[t->block_count - 1] + t->block_used;
+  *stored = TEXT_BLOCK_SIZE - t->block_used;
+  if (*stored > length) *stored = length;
+  memcpy(block, s, *stored);
+  t->block_used += *stored;
+  return block;
+}
+
+// Edits leave the text as it is when memory runs out
+void text_insert(text *t, size_t offset, const char *s, size_t length) {
+  piece *left, *right;
+
+  if (!piece_split(t->root, offset, &left, &right)) {
+    t->root = piece_merge(left, right);
+    return;
+  }
+  while (length > 0) {
+    size_t stored;
+    const char *chars = text_append(t, s, length, &stored);
+
+    if (chars == NULL) break;
+    s += stored;
+    length -= stored;
+    // a block holds more than a piece, runs are cut like the original buffer
+    for (size_t n; stored > 0; chars += n, stored -= n) {
+      n = text_piece_length(chars, stored);
+      // pieces never cross blocks, the start of a block begins a new piece
+      if (chars == t->blocks[t->block_count - 1] ||
+          !piece_extend(left, chars, n)) {
+        left = piece_merge(left, piece_new(chars, n));
+      }
+    }
+  }
+  t->root = piece_merge(left, right);
+}
+
+// Insert the treap pieces at offset, their chars are not copied
+void text_insert_pieces(text *t, size_t offset, piece *pieces) {
+  piece *left, *right;
+
+  if (!piece_split(t->root, offset, &left, &right)) {
+    t->root = piece_merge(left, right);
+    piece_free(pieces);
+    return;
+  }
+  t->root = piece_merge(piece_merge(left, pieces), right);
+}
+
+void text_delete(text *t, size_t offset, size_t length) {
+  piece *left, *middle, *right;
+
+  if (!piece_split(t->root, offset, &left, &right)) {
+    t->root = piece_merge(left, right);
+    return;
+  }
+  if (!piece_split(right, length, &middle, &right)) {
+    t->root = piece_merge(left, piece_merge(middle, right));
+    return;
+  }
+  piece_free(middle);
+  t->root = piece_merge(left, right);
+}
+
+// Offset of the first char of line (0 based). Lines past the end map to the
+// end of the text.
+size_t text_line_offset(text *t, size_t line) {
+  piece *p = t->root;
+  size_t offset = 0;
+
+  if (line == 0) return 0;
+
+  // look for the piece holding the line-th newline
+  while (p) {
+    size_t left_newlines = p->left ? p->left->subtree_newlines : 0;
+    size_t left_length = p->left ? p->left->subtree_length : 0;
+
+    if (line <= left_newlines) {
+      p = p->left;
+    } else if (line <= left_newlines + p->newlines) {
+      const char *s = p->chars;
+
+      line -= left_newlines;
+      while (1) {
+        s = SCAN->find(s, p->chars + p->length - s, '\n') + 1;
+        if (--line == 0) break;
+      }
+      return offset + left_length + (s - p->chars);
+    } else {
+      line -= left_newlines + p->newlines;
+      offset += left_length + p->length;
+      p = p->right;
+    }
+  }
+  return text_length(t);
+}
+
+// Line (0 based) holding the char at offset, the inverse of text_line_offset
+size_t text_line_at(text *t, size_t offset) {
+  piece *p = t->root;
+  size_t line = 0;
+
+  while (p) {
+    size_t left_newlines = p->left ? p->left->subtree_newlines : 0;
+    size_t left_length = p->left ? p->left->subtree_length : 0;
+
+    if (offset < left_length) {
+      p = p->left;
+    } else if (offset < left_length + p->length) {
+      return line + left_newlines + 
+        text_count_newlines(p->chars, offset - left_length);
+    } else {
+      line += left_newlines + p->newlines;
+      offset -= left_length + p->length;
+      p = p->right;
+    }
+  }
+  return line;
+}
+
+// Length of line, without its newline
+size_t text_line_length(text *t, size_t line) {
+  size_t start = text_line_offset(t, line);
+
+  if (line + 1 >= text_line_count(t)) return text_length(t) - start;
+  return text_line_offset(t, line + 1) - 1 - start;
+}
+
+// Return a pointer to the length chars at offset when they are contiguous in
+// memory (inside a single piece), NULL otherwise
+const char *text_span(text *t, size_t offset, size_t length) {
+  piece *p = t->root;
+
+  while (p) {
+    size_t left_length = p->left ? p->left->subtree_length : 0;
+
+    if (offset < left_length) {
+      p = p->left;
+    } else if (offset < left_length + p->length ||
+               (length == 0 && offset == left_length + p->length)) {
+      offset -= left_length;
+      if (offset + length > p->length) return NULL;
+      return p->chars + offset;
+    } else {
+      offset -= left_length + p->length;
+      p = p->right;
+    }
+  }
+  return length == 0 ? "" : NULL;
+}
+
+void text_read(text *t, size_t offset, size_t length, char *dest) {
+  piece_read(t->root, offset, length, dest);
+}
+
+static struct termios terminal_interface;
+
+void disable_raw_mode(int input_fd) {
+  if (EDITOR.terminal_raw_mode) {
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);   // bracketed paste off
+    if (EDITOR.kitty_keyboard) write(STDOUT_FILENO, "\x1b[<u", 4);
+    tcsetattr(input_fd, TCSAFLUSH, &terminal_interface);
+  }
+}
+
+void journal_flush(void);
+
+// ensure we are out of raw mode at exit, with the last edits journaled
+void editor_on_exit(void) {
+  disable_raw_mode(STDIN_FILENO);
+  journal_flush();
+  stats_trace_close();
+}
+
+int enable_raw_mode(int input_fd) {
+  struct termios raw;
+
+  if (EDITOR.terminal_raw_mode) return 0;   // already enabled
+  if (!isatty(input_fd)) goto fatal;
+  atexit(editor_on_exit);
+
+  if (tcgetattr(input_fd, &terminal_interface) == -1) goto fatal;
+
+  raw = terminal_interface;
+
+  // input modes: no break, no CR to NL, no parity check, no strip char, 
+  // no start/stop output control
+  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+
+  // output modes: disable post processing
+  raw.c_oflag &= ~(OPOST);
+
+  // control modes: set to 8 bit characters
+  raw.c_cflag |= (CS8);
+
+  // local modes: choing off, canonical off, no extended functions,
+  // no signal chars (^Z, ^C)
+  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+
+  // control chars - set return condition: reads never wait, waiting for
+  // input is the job of the event loop
+  raw.c_cc[VMIN] = 0;
+  raw.c_cc[VTIME] = 0;
+
+  // put terminal in raw mode after flushing
+  if (tcsetattr(input_fd, TCSAFLUSH, &raw) < 0) goto fatal;
+  EDITOR.terminal_raw_mode = true;
+
+  // have pastes bracketed by ESC [200~ and ESC [201~, so they can be told
+  // apart from typing and inserted in one go
+  write(STDOUT_FILENO, "\x1b[?2004h", 8);
+  return 0;
+
+fatal:
+  errno = ENOTTY;
+  return -1;
+}
+
+// The main loop sleeps in poll() on the file descriptors it watches (the
+// terminal, the pipe signal handlers write to, later the REPL subprocess)
+// until one is ready or the nearest timer expires. Nothing runs while idle.
+#define EVENT_MAX_WATCHES 8
+#define EVENT_MAX_TIMERS 8
+
+typedef struct event_loop {
+  struct pollfd fds[EVENT_MAX_WATCHES];
+  void (*on_ready[EVENT_MAX_WATCHES])(int fd);
+  int watch_count;
+  short revents;                // of the fd being handled
+
+  // one shot timers, a deadline of 0 is a free slot
+  long long deadlines[EVENT_MAX_TIMERS];
+  void (*on_expire[EVENT_MAX_TIMERS])(void);
+
+  // signal handlers only write the signal number here
+  int signal_pipe[2];
+  void (*on_signal[NSIG])(void);
+} event_loop;
+
+static event_loop EVENTS;
+
+// Call on_ready(fd) whenever fd has data to read, or hung up, see
+// EVENTS.revents
+int event_watch(int fd, void (*on_ready)(int fd)) {
+  if (EVENTS.watch_count == EVENT_MAX_WATCHES) return -1;
+  EVENTS.fds[EVENTS.watch_count].fd = fd;
+  EVENTS.fds[EVENTS.watch_count].events = POLLIN;
+  EVENTS.on_ready[EVENTS.watch_count] = on_ready;
+  EVENTS.watch_count++;
+  return 0;
+}
+
+void event_unwatch(int fd) {
+  for (int i = 0; i < EVENTS.watch_count; i++) {
+    if (EVENTS.fds[i].fd != fd) continue;
+    EVENTS.watch_count--;
+    EVENTS.fds[i] = EVENTS.fds[EVENTS.watch_count];
+    EVENTS.on_ready[i] = EVENTS.on_ready[EVENTS.watch_count];
+    return;
+  }
+}
+
+// Call on_expire once in ms milliseconds. A timer is known by its callback,
+// starting it again moves its deadline
+int event_timer_start(void (*on_expire)(void), int ms) {
+  int free_slot = -1;
+
+  for (int i = 0; i < EVENT_MAX_TIMERS; i++) {
+    if (EVENTS.deadlines[i] && EVENTS.on_expire[i] == on_expire) {
+      free_slot = i;
+      break;
+    }
+    if (EVENTS.deadlines[i] == 0 && free_slot == -1) free_slot = i;
+  }
+  if (free_slot == -1) return -1;
+  EVENTS.deadlines[free_slot] = stats_now() / 1000 + ms;
+  EVENTS.on_expire[free_slot] = on_expire;
+  return 0;
+}
+
+void event_timer_stop(void (*on_expire)(void)) {
+  for (int i = 0; i < EVENT_MAX_TIMERS; i++) {
+    if (EVENTS.on_expire[i] == on_expire) EVENTS.deadlines[i] = 0;
+  }
+}
+
+void screen_schedule_refresh(void);
+
+// The status message goes away after CLINE_STATUS_TIMEOUT, unless the line
+// number is prompted there
+#define CLINE_STATUS_TIMEOUT 5000
+
+void editor_on_status_timeout(void) {
+  if (EDITOR.prompting) return;
+  EDITOR.status_message[0] = '\0';
+  screen_schedule_refresh();
+}
+
+void editor_set_status_message(const char *format, ...) {
+  va_list ap;
+
+  va_start(ap, format);
+  vsnprintf(EDITOR.status_message, sizeof(EDITOR.status_message), format, ap);
+  va_end(ap);
+  event_timer_start(editor_on_status_timeout, CLINE_STATUS_TIMEOUT);
+}
+
+void event_on_signal_handler(int signal) {
+  int saved_errno = errno;
+  unsigned char c = signal;
+
+  write(EVENTS.signal_pipe[1], &c, 1);
+  errno = saved_errno;
+}
+
+void event_on_signal_pipe(int fd) {
+  unsigned char signals[64];
+  int nread;
+
+  while ((nread = read(fd, signals, sizeof(signals))) > 0) {
+    for (int i = 0; i < nread; i++) {
+      if (EVENTS.on_signal[signals[i]]) EVENTS.on_signal[signals[i]]();
+    }
+  }
+}
+
+// Call on_signal from the main loop, not from the signal handler, when signal
+// is received
+int event_signal(int signal, void (*on_signal)(void)) {
+  struct sigaction action;
+
+  if (EVENTS.signal_pipe[0] == 0) {
+    if (pipe(EVENTS.signal_pipe) == -1) return -1;
+    fcntl(EVENTS.signal_pipe[0], F_SETFL, O_NONBLOCK);
+    fcntl(EVENTS.signal_pipe[1], F_SETFL, O_NONBLOCK);
+    if (event_watch(EVENTS.signal_pipe[0], event_on_signal_pipe) == -1) {
+      return -1;
+    }
+  }
+
+  EVENTS.on_signal[signal] = on_signal;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = event_on_signal_handler;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  return sigaction(signal, &action, NULL);
+}
+
+// Sleep until a watched fd is ready or a timer expires, then handle it
+void event_loop_once(void) {
+  long long now = stats_now() / 1000, nearest = -1;
+  int timeout = -1, ready;
+
+  for (int i = 0; i < EVENT_MAX_TIMERS; i++) {
+    if (EVENTS.deadlines[i] == 0) continue;
+    if (nearest == -1 || EVENTS.deadlines[i] < nearest) {
+      nearest = EVENTS.deadlines[i];
+    }
+  }
+  if (nearest != -1) timeout = nearest > now ? nearest - now : 0;
+
+  ready = poll(EVENTS.fds, EVENTS.watch_count, timeout);
+  if (ready == -1 && errno != EINTR) exit(1);
+
+  for (int i = 0; ready > 0 && i < EVENTS.watch_count; i++) {
+    if (EVENTS.fds[i].revents == 0) continue;
+    ready--;
+    EVENTS.revents = EVENTS.fds[i].revents;
+    EVENTS.on_ready[i](EVENTS.fds[i].fd);
+  }
+
+  now = stats_now() / 1000;
+  for (int i = 0; i < EVENT_MAX_TIMERS; i++) {
+    if (EVENTS.deadlines[i] == 0 || EVENTS.deadlines[i] > now) continue;
+    EVENTS.deadlines[i] = 0;
+    EVENTS.on_expire[i]();
+  }
+}
+
+// Input is read in large chunks into a ring buffer, then decoded into a queue
+// of keys. A burst of input, a paste, costs a handful of reads and the main
+// loop handles all of its keys before rendering a single frame.
+#define INPUT_RING_SIZE (64 * 1024)     // both sizes are powers of two
+#define INPUT_QUEUE_SIZE 4096
+
+typedef struct input {
+  unsigned char ring[INPUT_RING_SIZE];
+  unsigned int ring_head;       // bytes waiting are in [ring_tail, ring_head)
+  unsigned int ring_tail;
+  int keys[INPUT_QUEUE_SIZE];
+  unsigned int key_head;        // keys waiting are in [key_tail, key_head)
+  unsigned int key_tail;
+
+  // text of the bracketed paste being received, or of the last PASTE key
+  bool pasting;
+  char *paste;
+  size_t paste_length;
+  size_t paste_capacity;
+
+  // the last MOUSE key: button (64 and 65 for the wheel), 0 based cell
+  int mouse_button;
+  int mouse_x;
+  int mouse_y;
+  bool mouse_pressed;
+
+  // the cursor position reported, 1 based, once asked by screen_query_terminal
+  bool position_asked;
+  int position_row;
+  int position_column;
+} input;
+
+static input INPUT;
+
+// Read whatever the terminal has, up to the free space of the ring. With the
+// terminal in raw mode this returns 0 at once without input.
+int input_fill(int input_fd) {
+  unsigned int free_space = INPUT_RING_SIZE - (INPUT.ring_head - INPUT.ring_tail);
+  unsigned int start = INPUT.ring_head & (INPUT_RING_SIZE - 1);
+  unsigned int contiguous = INPUT_RING_SIZE - start;
+  int nread;
+
+  if (free_space == 0) return 0;
+  if (contiguous > free_space) contiguous = free_space;
+  nread = read(input_fd, INPUT.ring + start, contiguous);
+  STATS.reads++;
+  if (nread > 0) INPUT.ring_head += nread;
+  return nread;
+}
+
+int input_peek(unsigned int i) {
+  if (INPUT.ring_tail + i >= INPUT.ring_head) return -1;
+  return INPUT.ring[(INPUT.ring_tail + i) & (INPUT_RING_SIZE - 1)];
+}
+
+// Move the bytes of a bracketed paste from the ring to INPUT.paste, up to the
+// closing ESC [201~ which yields the PASTE key. *key is -1 while the paste
+// goes on.
+int input_decode_paste(int *key) {
+  static const char end[] = "\x1b[201~";
+  unsigned int used = 0;
+  int c;
+
+  *key = -1;
+  while ((c = input_peek(used)) != -1) {
+    if (c == ESC) {
+      unsigned int i = 1;
+      int d;
+
+      while (i < sizeof(end) - 1 && (d = input_peek(used + i)) == end[i]) i++;
+      if (i == sizeof(end) - 1) {
+        INPUT.pasting = false;
+        *key = PASTE;
+        used += i;
+        break;
+      }
+      if (d == -1) break;     // might be the end marker, wait for the rest
+    }
+
+    if (INPUT.paste_length == INPUT.paste_capacity) {
+      size_t capacity = INPUT.paste_capacity ? INPUT.paste_capacity * 2 : 4096;
+      char *paste = stats_realloc(INPUT.paste, capacity);
+
+      if (paste == NULL) break;
+      INPUT.paste = paste;
+      INPUT.paste_capacity = capacity;
+    }
+    INPUT.paste[INPUT.paste_length++] = c;
+    used++;
+  }
+  return used;
+}
+
+// Keys of the final bytes of CSI and SS3 sequences: ESC [ A, ESC O A,
+// ESC [ 1 ; 5 A (with modifiers)...
+static const int INPUT_FINAL_KEYS[128] = {
+  ['A'] = ARROW_UP, ['B'] = ARROW_DOWN, ['C'] = ARROW_RIGHT, 
+  ['D'] = ARROW_LEFT, ['H'] = HOME_KEY, ['F'] = END_KEY,
+  ['P'] = F1, ['Q'] = F1 + 1, ['R'] = F1 + 2, ['S'] = F1 + 3,
+  ['Z'] = TAB | KEY_SHIFT
+};
+
+// Keys of the ESC [ number ~ sequences
+static const int INPUT_TILDE_KEYS[35] = {
+  [1] = HOME_KEY, [2] = INSERT_KEY, [3] = DEL, [4] = END_KEY, [5] = PAGE_UP,
+  [6] = PAGE_DOWN, [7] = HOME_KEY, [8] = END_KEY,
+  [11] = F1, [12] = F1 + 1, [13] = F1 + 2, [14] = F1 + 3, [15] = F1 + 4,
+  [17] = F1 + 5, [18] = F1 + 6, [19] = F1 + 7, [20] = F1 + 8, [21] = F1 + 9,
+  [23] = F1 + 10, [24] = F1 + 11
+};
+
+#define INPUT_MAX_PARAMS 8
+#define INPUT_MAX_SEQUENCE 64   // longer sequences are dropped
+#define INPUT_MAX_PARAM 0x10ffff // the largest code point a parameter holds
+
+// A control sequence, ESC [ then parameters, intermediate bytes and a final
+// byte. Parameters are ';' separated numbers, with ':' separated fields
+typedef struct input_sequence {
+  int prefix;                   // private marker, '<' to '?', or 0
+  int params[INPUT_MAX_PARAMS]; // first field of each, 0 when empty
+  int param_count;
+  int event;                    // second field of the second parameter
+  int intermediate;
+  int final;
+} input_sequence;
+
+// Parse the control sequence at the start of the ring into s. Returns its
+// length, 0 when it has not all arrived yet
+int input_parse_csi(input_sequence *s) {
+  int field = 0, c;
+
+  memset(s, 0, sizeof(*s));
+  for (unsigned int i = 2; i < INPUT_MAX_SEQUENCE; i++) {
+    if ((c = input_peek(i)) == -1) return 0;
+    if (c >= '0' && c <= '9') {
+      int *value = field == 0 ? &s->params[s->param_count] : 
+        field == 1 && s->param_count == 1 ? &s->event : NULL;
+
+      // parameters stop growing at INPUT_MAX_PARAM, no key goes past it
+      if (value) *value = *value * 10 + c - '0';
+      if (value && *value > INPUT_MAX_PARAM) *value = INPUT_MAX_PARAM;
+    } else if (c == ';') {
+      if (s->param_count < INPUT_MAX_PARAMS - 1) s->param_count++;
+      field = 0;
+    } else if (c == ':') {
+      field++;
+    } else if (c >= '<' && c <= '?') {
+      s->prefix = c;
+    } else if (c >= ' ' && c <= '/') {
+      s->intermediate = c;
+    } else {
+      // the final byte, or a byte breaking the sequence off
+      s->param_count++;
+      s->final = c;
+      return i + 1;
+    }
+  }
+  return INPUT_MAX_SEQUENCE;
+}
+
+// Modifier bits of a parameter coding them as 1 + shift 1, alt 2, ctrl 4
+int input_modifiers(int param) {
+  int bits = param > 1 ? param - 1 : 0;
+
+  return (bits & 1 ? KEY_SHIFT : 0) | (bits & 2 ? KEY_ALT : 0) |
+    (bits & 4 ? KEY_CTRL : 0);
+}
+
+// Key of the control sequence s, -1 for the ones that are not keys
+int input_sequence_key(input_sequence *s) {
+  int key, modifiers = input_modifiers(s->params[1]);
+
+  if (s->intermediate) return -1;
+  if (s->prefix == '<' && (s->final == 'M' || s->final == 'm') &&
+      s->param_count == 3) {
+    // SGR mouse: button ; column ; row, M pressed, m released
+    INPUT.mouse_button = s->params[0];
+    INPUT.mouse_x = s->params[1] - 1;
+    INPUT.mouse_y = s->params[2] - 1;
+    INPUT.mouse_pressed = s->final == 'M';
+    return MOUSE;
+  }
+  if (s->prefix) return -1;
+  switch (s->final) {
+  case '~':
+    if (s->params[0] < 0 ||
+        s->params[0] >= (int)(sizeof(INPUT_TILDE_KEYS) / sizeof(int))) {
+      return -1;
+    }
+    key = INPUT_TILDE_KEYS[s->params[0]];
+    break;
+  case 'u':
+    // kitty keyboard protocol: code point ; modifiers, releases are not keys
+    key = s->params[0];
+    if (key >= 128 || s->event == 3) return -1;
+    if ((modifiers & ~KEY_SHIFT) == KEY_CTRL && key >= 'a' && key <= 'z') {
+      return CTRL_KEY(key);
+    }
+    break;
+  default:
+    // keys send no number, or 1 before modifiers. ESC [ row ; column R is
+    // a cursor position report, not F3
+    if (s->params[0] > 1) return -1;
+    key = s->final < 128 ? INPUT_FINAL_KEYS[s->final] : 0;
+  }
+  return key ? key | modifiers : -1;
+}
+
+// Handle the replies of the terminal to screen_query_terminal. Returns whether
+// s is one, *key being the key it yields or -1
+bool input_on_reply(input_sequence *s, int *key) {
+  *key = -1;
+  if (INPUT.position_asked && !s->prefix && s->final == 'R' &&
+      s->param_count == 2) {
+    // ESC [ row ; column R, only when asked: ESC [ 1 ; 2 R is Shift-F3
+    INPUT.position_asked = false;
+    INPUT.position_row = s->params[0];
+    INPUT.position_column = s->params[1];
+    *key = CURSOR_POSITION;
+    return true;
+  }
+  if (s->prefix != '?') return false;
+  switch (s->final) {
+  case 'y':
+    // ESC [ ? 2026 ; mode $ y, mode 1 or 2 when known
+    if (s->intermediate == '$' && s->params[0] == 2026 &&
+        !EDITOR.synchronized_forced) {
+      EDITOR.synchronized_output = s->params[1] == 1 || s->params[1] == 2;
+    }
+    break;
+  case 'u':
+    // ESC [ ? flags u: the kitty keyboard protocol is there, turn on its
+    // disambiguated keys, where ESC is ESC [ 27 u and never waits a timeout
+    if (!EDITOR.kitty_keyboard) {
+      EDITOR.kitty_keyboard = true;
+      write(STDOUT_FILENO, "\x1b[>1u", 5);
+    }
+    break;
+  }
+  // the rest, the attributes ESC [ ? ... c among them, is dropped
+  return true;
+}
+
+// Decode one key at the start of the ring into *key, returning the number of
+// bytes it used, or 0 when the bytes waiting are the start of an incomplete
+// escape sequence. When timed_out, no more bytes are coming and an incomplete
+// sequence is just an ESC. ESC followed by a char is that char with Alt.
+int input_decode_key(int *key, bool timed_out) {
+  int c = input_peek(0), next, length;
+  input_sequence s;
+
+  if (INPUT.pasting) return input_decode_paste(key);
+  *key = c;
+  if (c != ESC) return 1;
+  if ((next = input_peek(1)) == -1) return timed_out;
+
+  if (next == 'O') {
+    // SS3, a single final byte
+    if ((c = input_peek(2)) == -1) return timed_out;
+    *key = c < 128 && INPUT_FINAL_KEYS[c] ? INPUT_FINAL_KEYS[c] : -1;
+    return 3;
+  }
+  if (next != '[') {
+    if (next < ' ' || next > '~') return 1;
+    *key = next | KEY_ALT;
+    return 2;
+  }
+
+  if ((length = input_parse_csi(&s)) == 0) return timed_out;
+  if (s.final == '~' && s.params[0] == 200) {
+    // ESC [200~ starts a paste
+    INPUT.pasting = true;
+    INPUT.paste_length = 0;
+    *key = -1;
+    return length;
+  }
+  if (input_on_reply(&s, key)) return length;
+  *key = input_sequence_key(&s);
+  return length;
+}
+
+// Move the keys of the ring to the key queue. Decoding stops after a PASTE
+// key: INPUT.paste holds its text until it is handled.
+void input_decode(bool timed_out) {
+  int key, used;
+
+  while (INPUT.ring_tail != INPUT.ring_head &&
+         INPUT.key_head - INPUT.key_tail < INPUT_QUEUE_SIZE) {
+    if ((used = input_decode_key(&key, timed_out)) == 0) break;
+    INPUT.ring_tail += used;
+    if (key == -1) continue;
+    STATS.keys++;
+    INPUT.keys[INPUT.key_head++ & (INPUT_QUEUE_SIZE - 1)] = key;
+    if (key == PASTE) break;
+  }
+}
+
+// Return the next decoded key, -1 when there are none left
+int input_next_key(void) {
+  if (INPUT.key_tail == INPUT.key_head) return -1;
+  return INPUT.keys[INPUT.key_tail++ & (INPUT_QUEUE_SIZE - 1)];
+}
+
+// Row payloads, the copies and renderings of rows, come from slabs cut in
+// power of two size classes kept on free lists. A payload gets its whole class
+// as capacity, so a row growing by a few chars while typing stays in place.
+// Payloads past the largest class get a slab of their own. Closing a file
+// frees every slab at once.
+#define SLAB_SIZE (64 * 1024)
+#define SLAB_MIN_SHIFT 5                // smallest class, 32 bytes
+#define SLAB_CLASSES 8                  // up to 4K
+
+typedef struct slab_allocator {
+  char **slabs;
+  int slab_count;
+  char *current;                        // slab classes are cut from
+  size_t used;
+  void *free_lists[SLAB_CLASSES];
+} slab_allocator;
+
+static slab_allocator SLAB;
+
+int slab_class(size_t size) {
+  int c = 0;
+
+  while (((size_t)1 << (c + SLAB_MIN_SHIFT)) < size) c++;
+  return c;
+}
+
+// Add a slab of size bytes
+char *slab_new(size_t size) {
+  char **slabs = stats_realloc(SLAB.slabs, 
+                               sizeof(char *) * (SLAB.slab_count + 1));
+  char *slab;
+
+  if (slabs == NULL) return NULL;
+  SLAB.slabs = slabs;
+  if ((slab = stats_malloc(size)) == NULL) return NULL;
+  SLAB.slabs[SLAB.slab_count++] = slab;
+  return slab;
+}
+
+// Return room for size bytes, *capacity gets the room actually given
+void *slab_alloc(size_t size, size_t *capacity) {
+  int c = slab_class(size);
+  void *p;
+
+  if (c >= SLAB_CLASSES) {
+    *capacity = size;
+    return slab_new(size);
+  }
+  *capacity = (size_t)1 << (c + SLAB_MIN_SHIFT);
+  if ((p = SLAB.free_lists[c]) != NULL) {
+    SLAB.free_lists[c] = *(void **)p;
+    return p;
+  }
+  if (SLAB.current == NULL || SLAB.used + *capacity > SLAB_SIZE) {
+    if ((SLAB.current = slab_new(SLAB_SIZE)) == NULL) return NULL;
+    SLAB.used = 0;
+  }
+  p = SLAB.current + SLAB.used;
+  SLAB.used += *capacity;
+  return p;
+}
+
+void slab_free(void *p, size_t capacity) {
+  int c = slab_class(capacity);
+
+  if (p == NULL) return;
+  if (c < SLAB_CLASSES) {
+    *(void **)p = SLAB.free_lists[c];
+    SLAB.free_lists[c] = p;
+    return;
+  }
+  for (int i = 0; i < SLAB.slab_count; i++) {
+    if (SLAB.slabs[i] != p) continue;
+    SLAB.slabs[i] = SLAB.slabs[--SLAB.slab_count];
+    free(p);
+    return;
+  }
+}
+
+// Free every payload
+void slab_release_all(void) {
+  for (int i = 0; i < SLAB.slab_count; i++) free(SLAB.slabs[i]);
+  free(SLAB.slabs);
+  memset(&SLAB, 0, sizeof(SLAB));
+}
+
+#define IS_UTF8_CONTINUATION(c) (((c) & 0xc0) == 0x80)
+
+// Decode the UTF-8 char at s into codepoint. Returns its length, or 0 when
+// the bytes are not a char: overlong, surrogate, out of range or cut short
+int utf8_decode(const char *s, size_t length, uint32_t *codepoint) {
+  const unsigned char *u = (const unsigned char *)s;
+  static const uint32_t least[] = {0, 0, 0x80, 0x800, 0x10000};
+  int n = u[0] < 0xc0 ? 0 : u[0] < 0xe0 ? 2 : u[0] < 0xf0 ? 3 
+                                            : u[0] < 0xf8 ? 4 : 0;
+  uint32_t c;
+
+  if (n == 0 || (size_t)n > length) return 0;
+  c = u[0] & (0x7f >> n);
+  for (int i = 1; i < n; i++) {
+    if ((u[i] & 0xc0) != 0x80) return 0;
+    c = c << 6 | (u[i] & 0x3f);
+  }
+  if (c < least[n] || c > 0x10ffff || (c >= 0xd800 && c <= 0xdfff)) return 0;
+  *codepoint = c;
+  return n;
+}
+
+// Columns taken by codepoint on the terminal: 0 for the combining and format
+// chars, drawn over the previous char, 2 for the wide East Asian chars and
+// emoji, 1 for the others
+int render_width(uint32_t c) {
+  static const uint32_t ranges[][3] = {
+    {0x0300, 0x036f, 0}, {0x0483, 0x0489, 0}, {0x0591, 0x05bd, 0},
+    {0x0610, 0x061a, 0}, {0x064b, 0x065f, 0}, {0x0e31, 0x0e31, 0},
+    {0x0e34, 0x0e3a, 0}, {0x0e47, 0x0e4e, 0}, {0x1100, 0x115f, 2},
+    {0x1ab0, 0x1aff, 0}, {0x1dc0, 0x1dff, 0}, {0x200b, 0x200f, 0},
+    {0x202a, 0x202e, 0}, {0x2060, 0x2064, 0}, {0x20d0, 0x20ff, 0},
+    {0x2e80, 0x303e, 2}, {0x3041, 0x33ff, 2}, {0x3400, 0x4dbf, 2},
+    {0x4e00, 0x9fff, 2}, {0xa000, 0xa4cf, 2}, {0xac00, 0xd7a3, 2},
+    {0xf900, 0xfaff, 2}, {0xfe00, 0xfe0f, 0}, {0xfe20, 0xfe2f, 0},
+    {0xfe30, 0xfe4f, 2}, {0xfeff, 0xfeff, 0}, {0xff00, 0xff60, 2},
+    {0xffe0, 0xffe6, 2}, {0x1f300, 0x1f64f, 2}, {0x1f900, 0x1f9ff, 2},
+    {0x20000, 0x2fffd, 2}, {0x30000, 0x3fffd, 2}, {0xe0100, 0xe01ef, 0}
+  };
+  int low = 0, high = sizeof(ranges) / sizeof(ranges[0]) - 1;
+
+  if (c < 0x300) return 1;
+  // the ranges are sorted
+  while (low <= high) {
+    int middle = (low + high) / 2;
+
+    if (c < ranges[middle][0]) high = middle - 1;
+    else if (c > ranges[middle][1]) low = middle + 1;
+    else return ranges[middle][2];
+  }
+  return 1;
+}
+
+// Columns taken by the char of length bytes at s, on a row where it starts at
+// column. Bytes that are not a char take one column each, like the control
+// chars, see screen_put_text
+int render_char_width(const char *s, size_t length, int column, int *bytes) {
+  uint32_t c;
+
+  *bytes = 1;
+  if (*s == TAB) return 8 - column % 8;
+  if (!(*s & 0x80) || (*bytes = utf8_decode(s, length, &c)) == 0) {
+    *bytes = 1;
+    return 1;
+  }
+  return c < 0xa0 ? 1 : render_width(c);
+}
+
+// Column in the rendering reached after the length chars at s, the first of
+// them being at column: a TAB goes to the next multiple of 8, multibyte chars
+// take their width. The ASCII runs between them are skipped in one go
+int render_columns(const char *s, size_t length, int column) {
+  const char *end = s + length, *tab = SCAN->find(s, length, TAB);
+
+  while (s < end) {
+    const char *special = SCAN->find_non_ascii(s, (tab ? tab : end) - s);
+    int bytes;
+
+    if (special == NULL) special = tab ? tab : end;
+    column += special - s;
+    if (special == end) break;
+    column += render_char_width(special, end - special, column, &bytes);
+    s = special + bytes;
+    if (special == tab) tab = SCAN->find(s, end - s, TAB);
+  }
+  return column;
+}
+
+// The line under the cursor is edited in a gap buffer: the chars before the
+// gap at the start of chars, the ones after it at the end. Typing and deleting
+// at the cursor only move the ends of the gap, whatever the length of the
+// line. The text gets the line back when the cursor leaves it or when an edit
+// of another kind comes, see editor_commit_line.
+typedef struct gap_buffer {
+  int line;                     // line held, -1 for none
+  size_t text_length;           // length of the line in the text
+  bool changed;
+  bool continued;               // committed but kept, see editor_checkpoint_line
+
+  char *chars;
+  size_t capacity;
+  size_t gap_start;
+  size_t gap_end;
+  size_t specials;              // TABs and non-ASCII chars, they need rendering
+  layout start;                 // of the first char shown
+  layout cursor;
+} gap_buffer;
+
+static gap_buffer LINE = {.line = -1, .start = {-1, 0}, .cursor = {-1, 0}};
+
+// Forget the layouts an edit at column changes: the ones of the chars after
+// it, or at it when deleting the char before
+void line_forget_layouts(size_t column, bool deleting) {
+  if (LINE.start.offset > (int)column - deleting) LINE.start.offset = -1;
+  if (LINE.cursor.offset > (int)column - deleting) LINE.cursor.offset = -1;
+}
+
+size_t line_length(void) {
+  return LINE.capacity - (LINE.gap_end - LINE.gap_start);
+}
+
+bool line_is_special(char c) {
+  return c == TAB || (c & 0x80);
+}
+
+// Move the gap to column, the chars between are moved to its other side
+void line_move_gap(size_t column) {
+  size_t n;
+
+  if (column < LINE.gap_start) {
+    n = LINE.gap_start - column;
+    memmove(LINE.chars + LINE.gap_end - n, LINE.chars + column, n);
+    LINE.gap_start -= n;
+    LINE.gap_end -= n;
+  } else if (column > LINE.gap_start) {
+    n = column - LINE.gap_start;
+    memmove(LINE.chars + LINE.gap_start, LINE.chars + LINE.gap_end, n);
+    LINE.gap_start += n;
+    LINE.gap_end += n;
+  }
+}
+
+// Give the buffer at least length chars of room besides the line, the gap
+// growing by doubling
+int line_reserve(size_t length) {
+  size_t capacity, after = LINE.capacity - LINE.gap_end;
+  char *chars;
+
+  if (LINE.gap_end - LINE.gap_start >= length) return 0;
+  capacity = LINE.capacity ? LINE.capacity : 256;
+  while (capacity - line_length() < length) capacity *= 2;
+  if ((chars = stats_realloc(LINE.chars, capacity)) == NULL) return -1;
+  memmove(chars + capacity - after, chars + LINE.gap_end, after);
+  LINE.chars = chars;
+  LINE.gap_end = capacity - after;
+  LINE.capacity = capacity;
+  return 0;
+}
+
+// Hold line index of the text, with the gap after its last char
+int line_load(int index) {
+  text *t = &EDITOR.text;
+  size_t length = text_line_length(t, index);
+
+  LINE.gap_start = LINE.gap_end = LINE.capacity = 0;
+  if (line_reserve(length + 1) == -1) return -1;
+  LINE.gap_start = length;
+  text_read(t, text_line_offset(t, index), length, LINE.chars);
+  LINE.specials = 0;
+  for (size_t i = 0; i < length; i++) {
+    LINE.specials += line_is_special(LINE.chars[i]);
+  }
+  LINE.line = index;
+  LINE.text_length = length;
+  LINE.changed = false;
+  LINE.continued = false;
+  LINE.start.offset = LINE.cursor.offset = -1;
+  return 0;
+}
+
+int line_insert(size_t column, char c) {
+  if (line_reserve(1) == -1) return -1;
+  line_move_gap(column);
+  LINE.chars[LINE.gap_start++] = c;
+  LINE.specials += line_is_special(c);
+  LINE.changed = true;
+  line_forget_layouts(column, false);
+  return 0;
+}
+
+// Delete the char before column
+void line_delete(size_t column) {
+  line_move_gap(column);
+  LINE.gap_start--;
+  LINE.specials -= line_is_special(LINE.chars[LINE.gap_start]);
+  LINE.changed = true;
+  line_forget_layouts(column, true);
+}
+
+// Column in the rendering reached after the chars of the line from from to
+// to, the one at from being at column, from both sides of the gap
+int line_render_columns(size_t from, size_t to, int column) {
+  if (LINE.specials == 0) return column + (to - from);
+  if (from < LINE.gap_start) {
+    size_t before = to < LINE.gap_start ? to : LINE.gap_start;
+
+    column = render_columns(LINE.chars + from, before - from, column);
+    from = before;
+  }
+  if (from >= to) return column;
+  return render_columns(LINE.chars + LINE.gap_end + (from - LINE.gap_start),
+                        to - from, column);
+}
+
+
+// The chars of the line, contiguous once the gap is moved after them
+const char *line_chars(void) {
+  line_move_gap(line_length());
+  return LINE.chars;
+}
+
+// Fill r with line index of the text. Lines inside a single piece are not
+// copied, the row points straight into the storage, or into the gap buffer
+// for the line being edited
+void row_fetch(row *r, int index) {
+  text *t = &EDITOR.text;
+  size_t offset, size;
+  char *copy;
+
+  r->index = index;
+  r->generation = ++EDITOR.row_generation;
+  r->start.offset = -1;
+  if (index == LINE.line) {
+    r->chars = line_chars();
+    r->size = line_length();
+    return;
+  }
+
+  offset = text_line_offset(t, index);
+  size = text_line_length(t, index);
+  r->size = size;
+  r->chars = text_span(t, offset, size);
+  if (r->chars != NULL) return;
+
+  if (r->copy_capacity == 0 && size <= ROW_INLINE_SIZE) {
+    copy = r->copy.small;
+  } else if (size <= r->copy_capacity) {
+    copy = r->copy.payload;
+  } else {
+    size_t capacity;
+
+    if (r->copy_capacity) slab_free(r->copy.payload, r->copy_capacity);
+    r->copy_capacity = 0;
+    if ((copy = slab_alloc(size, &capacity)) == NULL) {
+      r->size = 0;
+      r->chars = "";
+      return;
+    }
+    r->copy.payload = copy;
+    r->copy_capacity = capacity;
+  }
+  text_read(t, offset, size, copy);
+  r->chars = copy;
+}
+
+void row_release(row *r) {
+  if (r->copy_capacity) slab_free(r->copy.payload, r->copy_capacity);
+  r->copy_capacity = 0;
+}
+
+// Return the row of line index, fetching it only when it is not cached. Only
+// rows that are asked for, the ones reaching the screen, are ever built.
+row *editor_row(int index) {
+  row *r;
+
+  if (EDITOR.row_cache_size < 2 * EDITOR.screen_rows) {
+    int size = 2 * EDITOR.screen_rows;
+    row *rows = stats_calloc(size, sizeof(row));
+
+    if (rows == NULL) return NULL;
+    for (int i = 0; i < EDITOR.row_cache_size; i++) {
+      row_release(&EDITOR.rows[i]);
+    }
+    free(EDITOR.rows);
+    for (int i = 0; i < size; i++) rows[i].index = -1;
+    EDITOR.rows = rows;
+    EDITOR.row_cache_size = size;
+  }
+
+  r = &EDITOR.rows[index % EDITOR.row_cache_size];
+  if (r->index != index) row_fetch(r, index);
+  return r;
+}
+
+// Record an edit of the text touching the lines first to last. Their cached
+// rows are fetched again, and render again.
+void editor_text_changed(int first, int last) {
+  EDITOR.row_count = text_line_count(&EDITOR.text);
+  EDITOR.dirty = true;
+  for (int i = 0; i < EDITOR.row_cache_size; i++) {
+    row *r = &EDITOR.rows[i];
+
+    if (r->index < first || r->index > last) continue;
+    if (r->index < EDITOR.row_count) {
+      row_fetch(r, r->index);
+    } else {
+      r->index = -1;
+    }
+  }
+}
+
+void journal_record(int kind, size_t offset, const char *chars,
+                    size_t length);
+
+// Undo history: a log of the edits of the text, records of operations, not of
+// text. A record lists where the chars inserted or deleted are stored: the
+// original buffer and the append buffer never change, so undoing a delete
+// puts pieces pointing to the same chars back, whatever their size, and redo
+// is the same. Records are varint coded and end with their length, coded in
+// reverse, to be walked both ways. Past CLINE_UNDO_MEMORY bytes (1M) the
+// oldest half of the log goes to a temporary file, at the offset it has in
+// the log. Typing in a line is one record, written when the line is given
+// back to the text.
+#define HISTORY_MEMORY (1024 * 1024)
+
+enum HISTORY_RECORD {
+  HISTORY_INSERT = 1,
+  HISTORY_DELETE = 2,
+  HISTORY_JOINED = 4            // undone and redone with the previous record
+};
+
+typedef struct history {
+  unsigned char *log;           // the log from memory_start to end
+  size_t capacity;
+  size_t memory_start;
+  size_t end;
+  size_t position;              // records before are done, after undone
+  size_t memory_max;
+  FILE *spill;                  // the log before memory_start
+
+  // spans of the record being written
+  size_t span_count;
+  const char *span_chars;
+  size_t span_length;
+  uintptr_t span_previous;
+} history;
+
+static history HISTORY;
+
+int history_reserve(size_t length) {
+  size_t used = HISTORY.end - HISTORY.memory_start, capacity;
+  unsigned char *log;
+
+  if (used + length <= HISTORY.capacity) return 0;
+  capacity = HISTORY.capacity ? HISTORY.capacity : 4096;
+  while (capacity < used + length) capacity *= 2;
+  if ((log = stats_realloc(HISTORY.log, capacity)) == NULL) return -1;
+  HISTORY.log = log;
+  HISTORY.capacity = capacity;
+  return 0;
+}
+
+// Store value at p, 7 bits a byte, low bits first. Returns the bytes written,
+// the journal encodes its records the same way
+int history_encode_varint(unsigned char *p, unsigned long long value) {
+  int size = 0;
+
+  while (value >= 0x80) {
+    p[size++] = (value & 0x7f) | 0x80;
+    value >>= 7;
+  }
+  p[size++] = value;
+  return size;
+}
+
+void history_put_varint(unsigned long long value) {
+  unsigned char *p = HISTORY.log + (HISTORY.end - HISTORY.memory_start);
+
+  HISTORY.end += history_encode_varint(p, value);
+}
+
+int history_varint_size(unsigned long long value) {
+  int size = 1;
+
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+// A varint with its bytes in reverse order, read backwards from its end
+void history_put_reverse_varint(unsigned long long value) {
+  unsigned char *p = HISTORY.log + (HISTORY.end - HISTORY.memory_start);
+  int size = history_varint_size(value);
+
+  history_put_varint(value);
+  for (int i = 0; i < size / 2; i++) {
+    unsigned char c = p[i];
+
+    p[i] = p[size - 1 - i];
+    p[size - 1 - i] = c;
+  }
+}
+
+// Byte at position of the log, in memory or spilled
+unsigned char history_byte(size_t position) {
+  unsigned char c = 0;
+
+  if (position >= HISTORY.memory_start) {
+    return HISTORY.log[position - HISTORY.memory_start];
+  }
+  if (pread(fileno(HISTORY.spill), &c, 1, position) != 1) return 0;
+  return c;
+}
+
+unsigned long long history_get_varint(size_t *position) {
+  unsigned long long value = 0;
+  int shift = 0;
+  unsigned char c;
+
+  do {
+    c = history_byte((*position)++);
+    value |= (unsigned long long)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  return value;
+}
+
+typedef struct history_record {
+  int kind;
+  size_t offset;
+  size_t length;
+  size_t start;
+  size_t end;
+} history_record;
+
+// Parse the record at position into r, visit gets its spans
+void history_parse(size_t position, history_record *r, 
+                   void (*visit)(const char *chars, size_t length)) {
+  size_t count, body;
+  uintptr_t chars = 0;
+
+  r->start = position;
+  r->kind = history_byte(position++);
+  r->offset = history_get_varint(&position);
+  r->length = 0;
+  count = history_get_varint(&position);
+  for (size_t i = 0; i < count; i++) {
+    long long delta = history_get_varint(&position);
+    size_t length;
+
+    // zigzag coded distance from the end of the previous span
+    delta = (delta >> 1) ^ -(delta & 1);
+    chars += delta;
+    length = history_get_varint(&position);
+    if (visit) visit((const char *)chars, length);
+    chars += length;
+    r->length += length;
+  }
+  body = position - r->start;
+  r->end = position + history_varint_size(body);
+}
+
+// Record ending at position
+void history_parse_before(size_t position, history_record *r,
+                          void (*visit)(const char *chars, size_t length)) {
+  size_t body = 0;
+  int shift = 0;
+  unsigned char c;
+
+  // the length is coded backwards, its first byte last
+  do {
+    c = history_byte(--position);
+    body |= (size_t)(c & 0x7f) << shift;
+    shift += 7;
+  } while (c & 0x80);
+  history_parse(position - body, r, visit);
+}
+
+// Move the oldest half of the log in memory to the spill file
+void history_spill(void) {
+  size_t cut = HISTORY.memory_start, half;
+  history_record r;
+
+  if (HISTORY.spill == NULL && (HISTORY.spill = tmpfile()) == NULL) return;
+  half = HISTORY.memory_start + (HISTORY.end - HISTORY.memory_start) / 2;
+  while (cut < half && cut < HISTORY.position) {
+    history_parse(cut, &r, NULL);
+    cut = r.end;
+  }
+  if (cut == HISTORY.memory_start) return;
+  if (pwrite(fileno(HISTORY.spill), HISTORY.log, cut - HISTORY.memory_start,
+             HISTORY.memory_start) != (ssize_t)(cut - HISTORY.memory_start)) {
+    return;
+  }
+  memmove(HISTORY.log, HISTORY.log + (cut - HISTORY.memory_start),
+          HISTORY.end - cut);
+  HISTORY.memory_start = cut;
+}
+
+// Write the spans of a record, the last one when chars is NULL
+void history_span(const char *chars, size_t length) {
+  long long delta;
+
+  // spans following each other in memory are one
+  if (HISTORY.span_length && HISTORY.span_chars + HISTORY.span_length == chars) {
+    HISTORY.span_length += length;
+    return;
+  }
+  if (HISTORY.span_length) {
+    delta = (uintptr_t)HISTORY.span_chars - HISTORY.span_previous;
+    if (history_reserve(20) == -1) return;
+    history_put_varint(((unsigned long long)delta << 1) ^ 
+                       (unsigned long long)(delta >> 63));
+    history_put_varint(HISTORY.span_length);
+    HISTORY.span_previous = (uintptr_t)HISTORY.span_chars + HISTORY.span_length;
+  }
+  HISTORY.span_chars = chars;
+  HISTORY.span_length = length;
+}
+
+// Count the spans of a record, as history_span writes them
+void history_count_span(const char *chars, size_t length) {
+  if (HISTORY.span_length && HISTORY.span_chars + HISTORY.span_length == chars) {
+    HISTORY.span_length += length;
+    return;
+  }
+  HISTORY.span_count++;
+  HISTORY.span_chars = chars;
+  HISTORY.span_length = length;
+}
+
+// Append a record of the length chars at offset of the text, the ones just
+// inserted or about to be deleted. The undone records are dropped.
+void history_record_edit(int kind, size_t offset, size_t length) {
+  size_t start;
+
+  if (HISTORY.position < HISTORY.memory_start) {
+    HISTORY.memory_start = HISTORY.position;
+  }
+  HISTORY.end = HISTORY.position;
+
+  HISTORY.span_count = HISTORY.span_length = 0;
+  piece_spans(EDITOR.text.root, offset, length, history_count_span);
+  if (history_reserve(32) == -1) return;
+  start = HISTORY.end;
+  HISTORY.log[start - HISTORY.memory_start] = kind;
+  HISTORY.end++;
+  history_put_varint(offset);
+  history_put_varint(HISTORY.span_count);
+
+  HISTORY.span_length = 0;
+  HISTORY.span_previous = 0;
+  piece_spans(EDITOR.text.root, offset, length, history_span);
+  history_span(NULL, 0);
+  if (history_reserve(10) == -1) return;
+  history_put_reverse_varint(HISTORY.end - start);
+  HISTORY.position = HISTORY.end;
+  if (HISTORY.end - HISTORY.memory_start > HISTORY.memory_max) history_spill();
+}
+
+// Insert s at offset of the text, joined makes it one step with the previous
+// edit
+void history_insert(size_t offset, const char *s, size_t length, bool joined) {
+  int kind = HISTORY_INSERT | (joined ? HISTORY_JOINED : 0);
+
+  text_insert(&EDITOR.text, offset, s, length);
+  history_record_edit(kind, offset, length);
+  journal_record(kind, offset, s, length);
+}
+
+void history_delete(size_t offset, size_t length, bool joined) {
+  int kind = HISTORY_DELETE | (joined ? HISTORY_JOINED : 0);
+
+  history_record_edit(kind, offset, length);
+  journal_record(kind, offset, NULL, length);
+  text_delete(&EDITOR.text, offset, length);
+}
+
+// Pieces rebuilt from the spans of a record
+static piece *history_pieces;
+
+void history_add_piece(const char *chars, size_t length) {
+  // spans of the original buffer can be huge, pieces stay bounded
+  for (size_t n; length > 0; chars += n, length -= n) {
+    n = text_piece_length(chars, length);
+    history_pieces = piece_merge(history_pieces, piece_new(chars, n));
+  }
+}
+
+// Apply record r, forwards or backwards. *offset gets where the cursor goes.
+// The journal gets the edit made, joined to the previous one of the step.
+void history_apply(history_record *r, bool forwards, bool joined, 
+                   size_t *offset) {
+  bool insert = (r->kind & HISTORY_INSERT) != 0;
+  int joined_kind = joined ? HISTORY_JOINED : 0;
+
+  if (insert != forwards) {
+    journal_record(HISTORY_DELETE | joined_kind, r->offset, NULL, r->length);
+    text_delete(&EDITOR.text, r->offset, r->length);
+    *offset = r->offset;
+    return;
+  }
+  history_pieces = NULL;
+  history_parse(r->start, r, history_add_piece);
+  text_insert_pieces(&EDITOR.text, r->offset, history_pieces);
+  journal_record(HISTORY_INSERT | joined_kind, r->offset, NULL, r->length);
+  *offset = r->offset + r->length;
+}
+
+// Undo the last step, false when there is none
+bool history_undo(size_t *offset) {
+  history_record r;
+  bool first = true;
+
+  do {
+    if (HISTORY.position == 0) return !first;
+    history_parse_before(HISTORY.position, &r, NULL);
+    history_apply(&r, false, !first, offset);
+    HISTORY.position = r.start;
+    first = false;
+  } while (r.kind & HISTORY_JOINED);
+  return true;
+}
+
+bool history_redo(size_t *offset) {
+  history_record r;
+  bool first = true;
+
+  while (HISTORY.position < HISTORY.end) {
+    history_parse(HISTORY.position, &r, NULL);
+    if (!first && !(r.kind & HISTORY_JOINED)) break;
+    history_apply(&r, true, !first, offset);
+    HISTORY.position = r.end;
+    first = false;
+  }
+  return !first;
+}
+
+// Forget everything, for a new text
+void history_reset(void) {
+  HISTORY.memory_start = HISTORY.end = HISTORY.position = 0;
+  if (HISTORY.spill) fclose(HISTORY.spill);
+  HISTORY.spill = NULL;
+}
+
+// Give the line being edited back to the text. Only the chars between the
+// ones both versions of the line start and end with are replaced, that is
+// what the history records.
+void editor_commit_line(void) {
+  text *t = &EDITOR.text;
+  int line = LINE.line;
+  size_t offset, length = line_length(), prefix = 0, suffix = 0;
+  const char *chars;
+  char *old;
+  bool joined = LINE.continued;
+
+  if (line == -1) return;
+  LINE.line = -1;
+  LINE.continued = false;
+  if (!LINE.changed) return;
+  offset = text_line_offset(t, line);
+  chars = line_chars();
+  if ((old = stats_malloc(LINE.text_length + 1)) == NULL) return;
+  text_read(t, offset, LINE.text_length, old);
+  while (prefix < length && prefix < LINE.text_length && 
+         chars[prefix] == old[prefix]) {
+    prefix++;
+  }
+  while (suffix < length - prefix && suffix < LINE.text_length - prefix &&
+         chars[length - 1 - suffix] == old[LINE.text_length - 1 - suffix]) {
+    suffix++;
+  }
+  free(old);
+
+  offset += prefix;
+  if (LINE.text_length > prefix + suffix) {
+    history_delete(offset, LINE.text_length - prefix - suffix, joined);
+    joined = true;
+  }
+  if (length > prefix + suffix) {
+    history_insert(offset, chars + prefix, length - prefix - suffix, joined);
+  }
+  editor_text_changed(line, line);
+}
+
+// Give the line being edited back to the text, but go on editing it: its next
+// commit continues the same step of the history, a run of typing is undone
+// in one go however many times the journal timer took it
+void editor_checkpoint_line(void) {
+  int line = LINE.line;
+  size_t position = HISTORY.position;
+
+  if (line == -1 || !LINE.changed) return;
+  editor_commit_line();
+  LINE.line = line;
+  LINE.text_length = line_length();
+  LINE.changed = false;
+  LINE.continued = HISTORY.position != position;
+}
+
+// Edits are journaled next to the file, in .<name>.journal, as they are made:
+// after a crash, opening the file replays them. Records are kept in memory,
+// written by a timer every CLINE_JOURNAL_MS (1s) and put on disk by fdatasync
+// on a thread of its own, a key never waits for the disk. The journal starts
+// with the size and the modification time of the file its offsets refer to,
+// a journal of another version of the file is not replayed. Saving or
+// quitting removes it. Records are the edits made to the text, of the
+// HISTORY_ kinds, with the offset and the length of the chars inserted (that
+// follow) or deleted: undoing and redoing are journaled as the edits they
+// make, the history does not need to be rebuilt to replay them.
+#define JOURNAL_INTERVAL 1000
+#define JOURNAL_MAGIC "cline journal 2\n"
+#define JOURNAL_MAGIC_LENGTH 16
+
+typedef struct journal {
+  char *name;                   // NULL when not journaling
+  int fd;                       // -1 until the first write
+  long long size;               // of the file the edits apply to
+  long long mtime;
+  long long mtime_nsec;
+  int interval;
+  bool replaying;
+  bool scheduled;
+
+  // records not written yet
+  unsigned char *pending;
+  size_t pending_length;
+  size_t capacity;
+
+  // read by journal_open, for journal_replay
+  unsigned char *replay;
+  size_t replay_length;
+
+  // the sync thread takes sync_fd, a dup of fd, and closes it once synced
+  bool syncing;
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  int sync_fd;
+} journal;
+
+static journal JOURNAL = {
+  .fd = -1,
+  .interval = JOURNAL_INTERVAL,
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .wake = PTHREAD_COND_INITIALIZER,
+  .sync_fd = -1
+};
+
+// Number of bytes of the varint at p, 0 when it does not end before end
+int journal_decode_varint(const unsigned char *p, const unsigned char *end,
+                          unsigned long long *value) {
+  int size = 0, shift = 0;
+
+  *value = 0;
+  while (p + size < end && shift < 64) {
+    unsigned char c = p[size++];
+
+    *value |= (unsigned long long)(c & 0x7f) << shift;
+    if (!(c & 0x80)) return size;
+    shift += 7;
+  }
+  return 0;
+}
+
+int journal_header(unsigned char *header) {
+  int length = JOURNAL_MAGIC_LENGTH;
+
+  memcpy(header, JOURNAL_MAGIC, JOURNAL_MAGIC_LENGTH);
+  length += history_encode_varint(header + length, JOURNAL.size);
+  length += history_encode_varint(header + length, JOURNAL.mtime);
+  length += history_encode_varint(header + length, JOURNAL.mtime_nsec);
+  return length;
+}
+
+void *journal_run(void *arg) {
+  (void)arg;
+  for (;;) {
+    int fd;
+
+    pthread_mutex_lock(&JOURNAL.lock);
+    while (JOURNAL.sync_fd == -1) {
+      pthread_cond_wait(&JOURNAL.wake, &JOURNAL.lock);
+    }
+    fd = JOURNAL.sync_fd;
+    JOURNAL.sync_fd = -1;
+    pthread_mutex_unlock(&JOURNAL.lock);
+    fdatasync(fd);
+    close(fd);
+  }
+  return NULL;
+}
+
+// Have the sync thread put what was written on disk
+void journal_sync(void) {
+  if (!JOURNAL.syncing) {
+    if (pthread_create(&JOURNAL.thread, NULL, journal_run, NULL) != 0) {
+      fdatasync(JOURNAL.fd);
+      return;
+    }
+    pthread_detach(JOURNAL.thread);
+    JOURNAL.syncing = true;
+  }
+  pthread_mutex_lock(&JOURNAL.lock);
+  // a sync not started yet covers this write too
+  if (JOURNAL.sync_fd == -1) {
+    JOURNAL.sync_fd = dup(JOURNAL.fd);
+    pthread_cond_signal(&JOURNAL.wake);
+  }
+  pthread_mutex_unlock(&JOURNAL.lock);
+}
+
+// Write the records pending, the first ones create the journal
+void journal_write(void) {
+  size_t length = JOURNAL.pending_length;
+
+  if (length == 0 || JOURNAL.name == NULL) return;
+  JOURNAL.pending_length = 0;
+  if (JOURNAL.fd == -1) {
+    unsigned char header[JOURNAL_MAGIC_LENGTH + 30];
+    int header_length = journal_header(header);
+
+    JOURNAL.fd = open(JOURNAL.name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                      0600);
+    if (JOURNAL.fd == -1) goto fatal;
+    if (write(JOURNAL.fd, header, header_length) != header_length) goto fatal;
+  }
+  if (write(JOURNAL.fd, JOURNAL.pending, length) != (ssize_t)length) {
+    goto fatal;
+  }
+  journal_sync();
+  return;
+
+fatal:
+  editor_set_status_message("Journal not written: %s", strerror(errno));
+}
+
+// Journal the typing of the line being edited too, and write
+void journal_flush(void) {
+  editor_checkpoint_line();
+  journal_write();
+}
+
+void journal_on_timer(void) {
+  JOURNAL.scheduled = false;
+  journal_flush();
+}
+
+void journal_schedule(void) {
+  if (JOURNAL.scheduled || JOURNAL.name == NULL || JOURNAL.replaying) return;
+  JOURNAL.scheduled = event_timer_start(journal_on_timer,
+                                        JOURNAL.interval) == 0;
+}
+
+// Append a record to the pending ones: the length chars inserted at offset,
+// read from the text when chars is NULL, or deleted from there
+void journal_record(int kind, size_t offset, const char *chars,
+                    size_t length) {
+  bool insert = (kind & HISTORY_INSERT) != 0;
+  size_t needed;
+  unsigned char *p;
+
+  if (JOURNAL.name == NULL || JOURNAL.replaying) return;
+  needed = JOURNAL.pending_length + 21 + (insert ? length : 0);
+  if (needed > JOURNAL.capacity) {
+    size_t capacity = JOURNAL.capacity ? JOURNAL.capacity : 4096;
+
+    while (capacity < needed) capacity *= 2;
+    if ((p = stats_realloc(JOURNAL.pending, capacity)) == NULL) return;
+    JOURNAL.pending = p;
+    JOURNAL.capacity = capacity;
+  }
+  p = JOURNAL.pending + JOURNAL.pending_length;
+  *p++ = kind;
+  p += history_encode_varint(p, offset);
+  p += history_encode_varint(p, length);
+  if (insert) {
+    if (chars) {
+      memcpy(p, chars, length);
+    } else {
+      text_read(&EDITOR.text, offset, length, (char *)p);
+    }
+    p += length;
+  }
+  JOURNAL.pending_length = p - JOURNAL.pending;
+  journal_schedule();
+}
+
+// Remove the journal, the file on disk has every edit, or none is wanted
+void journal_discard(void) {
+  JOURNAL.pending_length = 0;
+  if (JOURNAL.name == NULL) return;
+  if (JOURNAL.fd != -1) close(JOURNAL.fd);
+  JOURNAL.fd = -1;
+  unlink(JOURNAL.name);
+}
+
+// Stop journaling, the edits not saved are given up
+void journal_stop(void) {
+  journal_discard();
+  free(JOURNAL.name);
+  JOURNAL.name = NULL;
+}
+
+// Journal the edits of filename, whose stat is st (zeroed for a new file),
+// and read the journal left by a previous run when it belongs to this version
+// of the file. Returns true when there are edits to replay.
+bool journal_open(const char *filename, struct stat *st) {
+  unsigned char header[JOURNAL_MAGIC_LENGTH + 30];
+  int header_length, fd;
+  const char *base = strrchr(filename, '/');
+  struct stat journal_st;
+
+  journal_write();
+  if (JOURNAL.fd != -1) close(JOURNAL.fd);
+  JOURNAL.fd = -1;
+  free(JOURNAL.name);
+  free(JOURNAL.replay);
+  JOURNAL.replay = NULL;
+
+  base = base ? base + 1 : filename;
+  if ((JOURNAL.name = malloc(strlen(filename) + 10)) == NULL) return false;
+  sprintf(JOURNAL.name, "%.*s.%s.journal", (int)(base - filename), filename,
+          base);
+  JOURNAL.size = st->st_size;
+  JOURNAL.mtime = st->st_mtim.tv_sec;
+  JOURNAL.mtime_nsec = st->st_mtim.tv_nsec;
+  header_length = journal_header(header);
+
+  if ((fd = open(JOURNAL.name, O_RDONLY)) == -1) return false;
+  if (fstat(fd, &journal_st) == -1 || journal_st.st_size < header_length ||
+      (JOURNAL.replay = malloc(journal_st.st_size)) == NULL) {
+    close(fd);
+    return false;
+  }
+  JOURNAL.replay_length = read(fd, JOURNAL.replay, journal_st.st_size);
+  close(fd);
+  if (JOURNAL.replay_length < (size_t)header_length ||
+      memcmp(JOURNAL.replay, header, header_length) != 0) {
+    editor_set_status_message("%s is not of this version of the file, ignored",
+                              JOURNAL.name);
+  } else if (JOURNAL.replay_length > (size_t)header_length) {
+    return true;
+  }
+  free(JOURNAL.replay);
+  JOURNAL.replay = NULL;
+  return false;
+}
+
+// Apply the edits of the journal read by journal_open to the text. A record
+// cut short by the crash ends the journal and is cut off, later edits append
+// to the rest. A whole record that does not apply to the text stops the
+// replay too: the journal is then kept aside, as .<name>.journal.failed, and
+// a new one starts with the edits recovered.
+void journal_replay(void) {
+  unsigned char header[JOURNAL_MAGIC_LENGTH + 30];
+  const unsigned char *p = JOURNAL.replay + journal_header(header);
+  const unsigned char *end = JOURNAL.replay + JOURNAL.replay_length;
+  const unsigned char *valid = p;
+  char *failed = NULL;
+  int count = 0;
+
+  JOURNAL.replaying = true;
+  while (p < end) {
+    int kind = *p++, size;
+    unsigned long long offset, length;
+    size_t text_size = text_length(&EDITOR.text);
+
+    if ((size = journal_decode_varint(p, end, &offset)) == 0) break;
+    p += size;
+    if ((size = journal_decode_varint(p, end, &length)) == 0) break;
+    p += size;
+    if (kind & HISTORY_INSERT && length > (size_t)(end - p)) break;
+    if ((kind & ~HISTORY_JOINED) != HISTORY_INSERT &&
+        (kind & ~HISTORY_JOINED) != HISTORY_DELETE) {
+      goto fatal;
+    }
+    if (offset > text_size) goto fatal;
+    if (kind & HISTORY_INSERT) {
+      history_insert(offset, (const char *)p, length, kind & HISTORY_JOINED);
+      p += length;
+    } else {
+      if (length > text_size - offset) goto fatal;
+      history_delete(offset, length, kind & HISTORY_JOINED);
+    }
+    valid = p;
+    count++;
+  }
+  JOURNAL.replaying = false;
+
+  JOURNAL.fd = open(JOURNAL.name, O_WRONLY | O_APPEND);
+  if (JOURNAL.fd != -1) ftruncate(JOURNAL.fd, valid - JOURNAL.replay);
+  editor_set_status_message("Recovered %d edits from %s", count, JOURNAL.name);
+  goto done;
+
+fatal:
+  JOURNAL.replaying = false;
+  if ((failed = malloc(strlen(JOURNAL.name) + 8)) != NULL) {
+    sprintf(failed, "%s.failed", JOURNAL.name);
+    rename(JOURNAL.name, failed);
+  }
+  JOURNAL.fd = open(JOURNAL.name, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND,
+                    0600);
+  if (JOURNAL.fd != -1) {
+    write(JOURNAL.fd, JOURNAL.replay, valid - JOURNAL.replay);
+  }
+  editor_set_status_message("Edit %d of the journal does not apply, "
+                            "%d recovered", count + 1, count);
+  free(failed);
+
+done:
+  free(JOURNAL.replay);
+  JOURNAL.replay = NULL;
+  EDITOR.dirty = count > 0;
+}
+
+// The line being edited changed, the row showing it is stale
+void editor_line_changed(void) {
+  row *r;
+
+  EDITOR.dirty = true;
+  journal_schedule();
+  if (EDITOR.row_cache_size == 0) return;
+  r = &EDITOR.rows[LINE.line % EDITOR.row_cache_size];
+  if (r->index == LINE.line) r->index = -1;
+}
+
+int editor_row_size(int index) {
+  if (index >= EDITOR.row_count) return 0;
+  if (index == LINE.line) return line_length();
+  return text_line_length(&EDITOR.text, index);
+}
+
+// Column in the rendering reached after the chars of line index from from to
+// to, the one at from being at column
+int editor_render_columns(int index, size_t from, size_t to, int column) {
+  if (index == LINE.line) return line_render_columns(from, to, column);
+  return render_columns(editor_row(index)->chars + from, to - from, column);
+}
+
+// Column in the rendering of the char at column of line index, carried on
+// from l, a layout of the line, when it is before column. l moves to column
+int editor_layout_column(int index, layout *l, size_t column) {
+  if (l->offset < 0 || (size_t)l->offset > column) {
+    l->offset = 0;
+    l->column = 0;
+  }
+  l->column = editor_render_columns(index, l->offset, column, l->column);
+  l->offset = column;
+  return l->column;
+}
+
+// Column in the rendering of the first char shown of line index, from the
+// one of the last frame when the line did not change
+int editor_start_column(int index) {
+  layout *l = index == LINE.line ? &LINE.start : &editor_row(index)->start;
+
+  return editor_layout_column(index, l, EDITOR.column_offset);
+}
+
+// Column in the rendering of the char under the cursor, on line index, from
+// where the cursor was when the line did not change. On the line being edited
+// typing carries it on over the chars typed
+int editor_cursor_column(int index, size_t column) {
+  layout *l = &LINE.cursor;
+
+  if (index != LINE.line) {
+    row *r = editor_row(index);
+
+    l = &EDITOR.cursor_layout;
+    if (EDITOR.cursor_generation != r->generation) {
+      l->offset = -1;
+      EDITOR.cursor_generation = r->generation;
+    }
+  }
+  if (l->offset < 0 || (size_t)l->offset > column) {
+    // back from the first char shown
+    editor_start_column(index);
+    *l = index == LINE.line ? LINE.start : editor_row(index)->start;
+  }
+  return editor_layout_column(index, l, column);
+}
+
+// Byte at column of line index
+char editor_row_char(int index, size_t column) {
+  if (index != LINE.line) return editor_row(index)->chars[column];
+  if (column < LINE.gap_start) return LINE.chars[column];
+  return LINE.chars[LINE.gap_end + (column - LINE.gap_start)];
+}
+
+// Length of the char at column of line index, 1 for a byte that is not one
+int editor_char_length(int index, int column) {
+  int size = editor_row_size(index), n = 0;
+  char bytes[4];
+  uint32_t c;
+
+  while (n < 4 && column + n < size) {
+    bytes[n] = editor_row_char(index, column + n);
+    n++;
+  }
+  n = n ? utf8_decode(bytes, n, &c) : 0;
+  return n ? n : 1;
+}
+
+// Start of the char holding the byte at column of line index: the cursor
+// moves over multibyte chars, and deletes them, whole
+int editor_char_start(int index, int column) {
+  int size = editor_row_size(index);
+
+  if (column >= size) return column;
+  for (int start = column; start >= 0 && start > column - 4; start--) {
+    if (!IS_UTF8_CONTINUATION(editor_row_char(index, start))) {
+      if (start < column && start + editor_char_length(index, start) > column) {
+        return start;
+      }
+      break;
+    }
+  }
+  return column;
+}
+
+// Scroll right until the cursor column, past TABs and wide chars, is on
+// screen, and column_offset on the first byte of a char
+void editor_scroll_columns(int file_row, int file_column) {
+  int offset = EDITOR.column_offset, end, start = 0;
+
+  while (offset < file_column && 
+         IS_UTF8_CONTINUATION(editor_row_char(file_row, offset))) {
+    offset++;
+  }
+  EDITOR.column_offset = offset;
+  // the span takes at most 7 columns more when it starts elsewhere than on
+  // a multiple of 8. Without TABs it takes as many wherever it starts, the
+  // line before it is looked at only otherwise
+  end = editor_render_columns(file_row, offset, file_column, 0);
+  if (end + 7 < EDITOR.screen_columns) return;
+  if (editor_render_columns(file_row, offset, file_column, 1) != end + 1) {
+    start = editor_start_column(file_row);
+  }
+  while (editor_render_columns(file_row, offset, file_column, start) - start >=
+         EDITOR.screen_columns) {
+    int next = offset + 1;
+
+    while (next < file_column && 
+           IS_UTF8_CONTINUATION(editor_row_char(file_row, next))) {
+      next++;
+    }
+    start = editor_render_columns(file_row, offset, next, start);
+    offset = next;
+  }
+  EDITOR.column_offset = offset;
+}
+
+// Place the cursor on file_row/file_column, scrolling so it stays on screen
+void editor_set_cursor(int file_row, int file_column) {
+  if (file_row != LINE.line) editor_commit_line();
+  if (file_row < EDITOR.row_offset) {
+    EDITOR.row_offset = file_row;
+  } else if (file_row >= EDITOR.row_offset + EDITOR.screen_rows) {
+    EDITOR.row_offset = file_row - EDITOR.screen_rows + 1;
+  }
+  if (file_column < EDITOR.column_offset) {
+    EDITOR.column_offset = file_column;
+  } else if (file_column >= EDITOR.column_offset + EDITOR.screen_columns) {
+    EDITOR.column_offset = file_column - EDITOR.screen_columns + 1;
+  }
+  if (file_row < EDITOR.row_count && file_column > EDITOR.column_offset) {
+    editor_scroll_columns(file_row, file_column);
+  }
+  EDITOR.cursor_y = file_row - EDITOR.row_offset;
+  EDITOR.cursor_x = file_column - EDITOR.column_offset;
+}
+
+// Offset in the text of the char under the cursor
+size_t editor_cursor_offset(void) {
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+
+  return text_line_offset(&EDITOR.text, file_row) + 
+    EDITOR.column_offset + EDITOR.cursor_x;
+}
+
+// Typing goes to the gap buffer of the line, past the end of the text to the
+// text itself
+void editor_insert_character(int c) {
+  char ch = c;
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+  int file_column = EDITOR.column_offset + EDITOR.cursor_x;
+
+  if (file_row >= EDITOR.row_count) {
+    history_insert(editor_cursor_offset(), &ch, 1, false);
+    editor_text_changed(file_row, file_row);
+  } else {
+    if (LINE.line != file_row && line_load(file_row) == -1) return;
+    if (line_insert(file_column, ch) == -1) return;
+    editor_line_changed();
+  }
+  editor_set_cursor(file_row, file_column + 1);
+}
+
+// Split the line at the cursor
+void editor_insert_line(void) {
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+
+  editor_commit_line();
+  history_insert(editor_cursor_offset(), "\n", 1, false);
+  editor_text_changed(file_row, INT_MAX);
+  editor_set_cursor(file_row + 1, 0);
+}
+
+// Insert length chars at the cursor as a single edit, leaving the cursor
+// after them
+void editor_insert_text(const char *s, size_t length) {
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+  size_t offset;
+
+  if (length == 0) return;
+  editor_commit_line();
+  offset = editor_cursor_offset() + length;
+  history_insert(offset - length, s, length, false);
+  editor_text_changed(file_row, memchr(s, '\n', length) ? INT_MAX : file_row);
+  file_row = text_line_at(&EDITOR.text, offset);
+  editor_set_cursor(file_row, 
+                    offset - text_line_offset(&EDITOR.text, file_row));
+}
+
+// Delete the char before the cursor, joining lines at the start of a line
+void editor_delete_character(void) {
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+  int file_column = EDITOR.column_offset + EDITOR.cursor_x;
+
+  if (file_row >= EDITOR.row_count) return;
+
+  if (file_column == 0) {
+    if (file_row == 0) return;
+    editor_commit_line();
+    file_column = editor_row_size(file_row - 1);
+    history_delete(editor_cursor_offset() - 1, 1, false);
+    file_row--;
+    editor_text_changed(file_row, INT_MAX);
+  } else {
+    int start = editor_char_start(file_row, file_column - 1);
+
+    if (LINE.line != file_row && line_load(file_row) == -1) return;
+    for (; file_column > start; file_column--) line_delete(file_column);
+    editor_line_changed();
+  }
+  editor_set_cursor(file_row, file_column);
+}
+
+// Move the cursor to the start of line (1 based), placing it in the middle of
+// the screen. Finding the line is a walk down the piece tree: no line is
+// split or counted, however large the file.
+void editor_go_to_line(int line) {
+  if (line > EDITOR.row_count) line = EDITOR.row_count;
+  if (line < 1) line = 1;
+  EDITOR.row_offset = line - 1 - EDITOR.screen_rows / 2;
+  if (EDITOR.row_offset < 0) EDITOR.row_offset = 0;
+  EDITOR.column_offset = 0;
+  editor_set_cursor(line - 1, 0);
+}
+
+// Undo, or redo, the last step and put the cursor where it happened
+void editor_undo(bool redo) {
+  size_t offset;
+  int file_row;
+
+  editor_commit_line();
+  if (!(redo ? history_redo(&offset) : history_undo(&offset))) {
+    editor_set_status_message("Nothing to %s", redo ? "redo" : "undo");
+    return;
+  }
+  editor_text_changed(0, INT_MAX);
+  file_row = text_line_at(&EDITOR.text, offset);
+  editor_set_cursor(file_row, 
+                    offset - text_line_offset(&EDITOR.text, file_row));
+}
+
+void editor_move_cursor(int key) {
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+  int file_column = EDITOR.column_offset + EDITOR.cursor_x;
+  int size = editor_row_size(file_row);
+
+  switch (key) {
+  case ARROW_LEFT:
+    if (file_column > 0) {
+      file_column = editor_char_start(file_row, file_column - 1);
+    } else if (file_row > 0) {
+      file_row--;
+      file_column = editor_row_size(file_row);
+    }
+    break;
+  case ARROW_RIGHT:
+    if (file_column < size) {
+      file_column += editor_char_length(file_row, file_column);
+    } else if (file_row + 1 < EDITOR.row_count) {
+      file_row++;
+      file_column = 0;
+    }
+    break;
+  case ARROW_UP:
+    if (file_row > 0) file_row--;
+    break;
+  case ARROW_DOWN:
+    if (file_row + 1 < EDITOR.row_count) file_row++;
+    break;
+  case HOME_KEY:
+    file_column = 0;
+    break;
+  case END_KEY:
+    file_column = size;
+    break;
+  case PAGE_UP:
+    file_row -= EDITOR.screen_rows;
+    if (file_row < 0) file_row = 0;
+    break;
+  case PAGE_DOWN:
+    file_row += EDITOR.screen_rows;
+    if (file_row >= EDITOR.row_count) file_row = EDITOR.row_count - 1;
+    if (file_row < 0) file_row = 0;
+    break;
+  }
+
+  // snap to the end of a shorter line, to the start of a char
+  size = editor_row_size(file_row);
+  if (file_column > size) file_column = size;
+  file_column = editor_char_start(file_row, file_column);
+  editor_set_cursor(file_row, file_column);
+}
+
+// Background line indexing: opening a large file only counts the newlines of
+// its beginning, enough for the first screens. A worker thread scans the rest
+// and publishes pieces with their newline counts in a ring; the main loop,
+// woken through a pipe, appends them to the end of the text. Until the scan
+// is done the text is a prefix of the file, that can be viewed and edited.
+#define INDEX_SYNC_LENGTH (256 * 1024)   // indexed by editor_open itself
+#define INDEX_RING_SIZE 1024            // pieces published, not yet appended
+#define INDEX_WAKE_PIECES 64            // pieces between two wakeups
+
+typedef struct index_piece {
+  const char *chars;
+  size_t length;
+  size_t newlines;
+} index_piece;
+
+typedef struct line_index {
+  // owned by the main thread
+  bool running;
+  pthread_t thread;
+  int pipe[2];                  // the worker writes a byte to wake the loop
+  const char *map;              // the whole file, chars is its tail
+  size_t map_length;
+  const char *chars;
+  size_t length;
+  size_t appended;              // chars of the tail now in the text
+  long long start;
+
+  // shared, under lock
+  pthread_mutex_t lock;
+  pthread_cond_t drained;
+  index_piece ring[INDEX_RING_SIZE];
+  unsigned int ring_head;
+  unsigned int ring_tail;
+  bool cancel;
+} line_index;
+
+static line_index INDEX = {
+  .lock = PTHREAD_MUTEX_INITIALIZER,
+  .drained = PTHREAD_COND_INITIALIZER
+};
+
+// Worker thread: cut and count the tail, publish the pieces. Pages scanned are
+// handed back to the page cache as it goes, the file is never resident whole.
+void *index_run(void *arg) {
+  size_t offset = 0, released = INDEX.chars - INDEX.map;
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned int published = 0;
+
+  (void)arg;
+  madvise((void *)INDEX.map, INDEX.map_length, MADV_SEQUENTIAL);
+  while (offset < INDEX.length) {
+    index_piece p;
+
+    p.chars = INDEX.chars + offset;
+    p.length = text_piece_length(p.chars, INDEX.length - offset);
+    p.newlines = text_count_newlines(p.chars, p.length);
+    offset += p.length;
+
+    pthread_mutex_lock(&INDEX.lock);
+    while (INDEX.ring_head - INDEX.ring_tail == INDEX_RING_SIZE && 
+           !INDEX.cancel) {
+      pthread_cond_wait(&INDEX.drained, &INDEX.lock);
+    }
+    if (INDEX.cancel) {
+      pthread_mutex_unlock(&INDEX.lock);
+      break;
+    }
+    INDEX.ring[INDEX.ring_head++ % INDEX_RING_SIZE] = p;
+    pthread_mutex_unlock(&INDEX.lock);
+
+    if (++published % INDEX_WAKE_PIECES == 0 || offset == INDEX.length) {
+      size_t scanned = INDEX.chars + offset - INDEX.map;
+
+      write(INDEX.pipe[1], "", 1);
+      scanned -= scanned % page_size;
+      if (scanned > released) {
+        madvise((void *)(INDEX.map + released), scanned - released,
+                MADV_DONTNEED);
+        released = scanned;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Stop the worker, giving up on the rest of the file
+void index_stop(void) {
+  if (!INDEX.running) return;
+  pthread_mutex_lock(&INDEX.lock);
+  INDEX.cancel = true;
+  pthread_cond_signal(&INDEX.drained);
+  pthread_mutex_unlock(&INDEX.lock);
+  pthread_join(INDEX.thread, NULL);
+
+  event_unwatch(INDEX.pipe[0]);
+  close(INDEX.pipe[0]);
+  close(INDEX.pipe[1]);
+  INDEX.running = false;
+}
+
+// The worker published pieces: append them to the text
+void index_on_ready(int fd) {
+  index_piece pieces[INDEX_RING_SIZE];
+  int count = 0, first = EDITOR.row_count - 1;
+  bool dirty = EDITOR.dirty, reload = LINE.line != -1 && LINE.line >= first;
+  char drain[64];
+  piece *tail = NULL;
+
+  // the line being edited may continue in the new pieces, it is loaded again
+  if (reload) editor_checkpoint_line();
+  while (read(fd, drain, sizeof(drain)) > 0);
+  pthread_mutex_lock(&INDEX.lock);
+  while (INDEX.ring_tail != INDEX.ring_head) {
+    pieces[count++] = INDEX.ring[INDEX.ring_tail++ % INDEX_RING_SIZE];
+  }
+  pthread_cond_signal(&INDEX.drained);
+  pthread_mutex_unlock(&INDEX.lock);
+  if (count == 0) return;
+
+  for (int i = 0; i < count; i++) {
+    piece *p = pieces[i].length ? 
+      piece_new_counted(pieces[i].chars, pieces[i].length, pieces[i].newlines) :
+      NULL;
 
-static struct termios terminal_interface;
+    tail = piece_merge(tail, p);
+    INDEX.appended += pieces[i].length;
+  }
+  EDITOR.text.root = piece_merge(EDITOR.text.root, tail);
+  if (reload) {
+    bool continued = LINE.continued;
 
-void disable_raw_mode(int input_fd) {
-  if (EDITOR.terminal_raw_mode) {
-    tcsetattr(input_fd, TCSAFLUSH, &terminal_interface);
+    if (line_load(LINE.line) == -1) LINE.line = -1;
+    LINE.continued = continued;
   }
-}
 
-// ensure we are out of raw mode at exit
-void editor_on_exit(void) {
-  disable_raw_mode(STDIN_FILENO);
-}
+  // the last line shown may continue in the new pieces. the file grew, it
+  // was not modified
+  editor_text_changed(first < 0 ? 0 : first, INT_MAX);
+  EDITOR.dirty = dirty;
 
-int enable_raw_mode(int input_fd) {
-  struct termios raw;
+  if (INDEX.appended == INDEX.length) {
+    index_stop();
+    stats_trace("index", INDEX.start, stats_now() - INDEX.start, "lines",
+                EDITOR.row_count);
+  }
+  screen_schedule_refresh();
+}
 
-  if (EDITOR.terminal_raw_mode) return 0;   // already enabled
-  if (!isatty(input_fd)) goto fatal;
-  atexit(editor_on_exit);
+// Start indexing the length chars at chars, the tail of map, in the
+// background
+int index_start(const char *map, size_t map_length, const char *chars,
+                size_t length) {
+  INDEX.map = map;
+  INDEX.map_length = map_length;
+  INDEX.chars = chars;
+  INDEX.length = length;
+  INDEX.appended = 0;
+  INDEX.ring_head = INDEX.ring_tail = 0;
+  INDEX.cancel = false;
+  INDEX.start = stats_now();
 
-  if (tcgetattr(input_fd, &terminal_interface) == -1) goto fatal;
+  if (pipe(INDEX.pipe) == -1) return -1;
+  fcntl(INDEX.pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(INDEX.pipe[1], F_SETFL, O_NONBLOCK);
+  if (event_watch(INDEX.pipe[0], index_on_ready) == -1) goto fatal;
+  if (pthread_create(&INDEX.thread, NULL, index_run, NULL) != 0) {
+    event_unwatch(INDEX.pipe[0]);
+    goto fatal;
+  }
+  INDEX.running = true;
+  return 0;
 
-  raw = terminal_interface;
+fatal:
+  close(INDEX.pipe[0]);
+  close(INDEX.pipe[1]);
+  return -1;
+}
 
-  // input modes: no break, no CR to NL, no parity check, no strip char, 
-  // no start/stop output control
-  raw.c_iflag &= ~(BRKINT | ICRNL | INPCK | ISTRIP | IXON);
+// Open filename as the text of the editor. The file is mapped read-only and
+// used as the original buffer of the piece table, which owns it: nothing is
+// copied, lines are read from the mapping until they are edited. Only the
+// beginning of a large file is indexed before returning, the rest is in the
+// background, unless a journal is replayed: its offsets may be anywhere. A
+// missing file is a new, empty text.
+int editor_open(char *filename) {
+  struct stat st;
+  char *map = NULL;
+  size_t indexed;
+  int fd;
+  bool recover;
 
-  // output modes: disable post processing
-  raw.c_oflag &= ~(OPOST);
+  index_stop();
+  LINE.line = -1;
+  history_reset();
 
-  // control modes: set to 8 bit characters
-  raw.c_cflag |= (CS8);
+  // the rows of the previous file go, their payloads with the slabs
+  for (int i = 0; i < EDITOR.row_cache_size; i++) {
+    memset(&EDITOR.rows[i], 0, sizeof(row));
+    EDITOR.rows[i].index = -1;
+  }
+  slab_release_all();
 
-  // local modes: choing off, canonical off, no extended functions,
-  // no signal chars (^Z, ^C)
-  raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
+  free(EDITOR.filename);
+  EDITOR.filename = strdup(filename);
 
-  // control chars - set return condition: min numbers of bytes and timer
-  raw.c_cc[VMIN] = 0;   // return each byte or 0 for timeout
-  raw.c_cc[VTIME] = 1;  // 100ms timeout (unit is 10s of second)
+  if ((fd = open(filename, O_RDONLY)) == -1) {
+    if (errno != ENOENT) goto fatal;
+    memset(&st, 0, sizeof(st));
+  } else {
+    if (fstat(fd, &st) == -1) goto fatal;
+    if (st.st_size > 0) {
+      map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) goto fatal;
+    }
+    close(fd);
+  }
+  recover = journal_open(filename, &st);
 
-  // put terminal in raw mode after flushing
-  if (tcsetattr(input_fd, TCSAFLUSH, &raw) < 0) goto fatal;
-  EDITOR.terminal_raw_mode = true;
+  // stop after a newline, the last line shown is not cut short
+  indexed = st.st_size;
+  if (indexed > INDEX_SYNC_LENGTH && !recover) {
+    indexed = INDEX_SYNC_LENGTH;
+    while (indexed > 0 && map[indexed - 1] != '\n') indexed--;
+    if (indexed == 0) indexed = INDEX_SYNC_LENGTH;
+  }
+  text_destroy(&EDITOR.text);
+  text_init(&EDITOR.text, map, indexed);
+  EDITOR.text.mapping = map;
+  EDITOR.text.mapping_length = st.st_size;
+  if (indexed < (size_t)st.st_size &&
+      index_start(map, st.st_size, map + indexed, 
+                  st.st_size - indexed) == -1) {
+    return -1;
+  }
+  EDITOR.dirty = false;
+  if (recover) journal_replay();
+  editor_text_changed(0, INT_MAX);
   return 0;
 
 fatal:
-  errno = ENOTTY;
+  if (fd != -1) close(fd);
   return -1;
 }
 
-// Read a key from the terminal put into raw mode
-int editor_read_key(int input_fd) {
-  int nread;
-  char c, seq[3];
-  while ((nread = read(input_fd, &c, 1)) == 0);
-  if (nread == -1) exit(1);
-
-  while (1) {
-    switch (c) {
-    case ESC:                   // escape sequence
-      // if this is just an ESC we will time out here
-      if (read(input_fd, seq, 1) == 0) return ESC;
-      if (read(input_fd, seq + 1, 1) == 0) return ESC;
-
-      // ESC [ sequences
-      if (seq[0] == '[') {
-        if (seq[1] >= '0' && seq[1] <= '9') {
-          // extended escape, read an additional byte
-          if (read(input_fd, seq + 2, 1)) return ESC;
-          if (seq[2] == '~') {
-            if (seq[1] == 'e') return DEL;
-          }
-        } else {
-          switch (seq[1]) {
-          case 'A': return ARROW_UP;
-          case 'B': return ARROW_DOWN;
-          case 'C': return ARROW_RIGHT;
-          case 'D': return ARROW_LEFT;
-          }
-        }
-      }
-      break;
-    default:
-      return c;
+// Write the text to the file: to a temporary file next to it, renamed over it
+// once on disk, so a crash leaves one version or the other whole. The part of
+// the file the index has not reached yet is copied from the mapping. The
+// journal has nothing left to recover, later edits start a new one.
+int editor_save(void) {
+  size_t length, chunk = 64 * 1024;
+  char *name = NULL, *chars = NULL, *slash, *target = NULL;
+  int fd = -1;
+  struct stat st, original;
+  bool exists;
+
+  if (EDITOR.filename == NULL) {
+    editor_set_status_message("No file name, nothing saved");
+    return -1;
+  }
+  editor_commit_line();
+  length = text_length(&EDITOR.text);
+  // a symlink stays, the file it points to is replaced
+  if ((target = realpath(EDITOR.filename, NULL)) == NULL) {
+    if (errno != ENOENT || (target = strdup(EDITOR.filename)) == NULL) {
+      goto fatal;
     }
   }
+  exists = stat(target, &original) == 0;
+  if ((name = malloc(strlen(target) + 8)) == NULL) goto fatal;
+  if ((slash = strrchr(target, '/')) != NULL) {
+    sprintf(name, "%.*s.%s.save", (int)(slash + 1 - target), target, 
+            slash + 1);
+  } else {
+    sprintf(name, ".%s.save", target);
+  }
+  if ((fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1) goto fatal;
+  // the new file gets the permissions and, when allowed, the owner of the
+  // one it replaces
+  if (exists) {
+    if (fchmod(fd, original.st_mode & 07777) == -1) goto fatal;
+    if (fchown(fd, original.st_uid, original.st_gid) == -1 && 
+        errno != EPERM) {
+      goto fatal;
+    }
+  }
+  if ((chars = malloc(chunk)) == NULL) goto fatal;
+  for (size_t offset = 0, n; offset < length; offset += n) {
+    n = length - offset < chunk ? length - offset : chunk;
+    text_read(&EDITOR.text, offset, n, chars);
+    if (write(fd, chars, n) != (ssize_t)n) goto fatal;
+  }
+  if (INDEX.running) {
+    size_t appended = INDEX.appended;
+
+    if (write(fd, INDEX.chars + appended, INDEX.length - appended) != 
+        (ssize_t)(INDEX.length - appended)) {
+      goto fatal;
+    }
+  }
+  if (fsync(fd) == -1 || fstat(fd, &st) == -1) goto fatal;
+  close(fd);
+  fd = -1;
+  if (rename(name, target) == -1) goto fatal;
+
+  journal_discard();
+  JOURNAL.size = st.st_size;
+  JOURNAL.mtime = st.st_mtim.tv_sec;
+  JOURNAL.mtime_nsec = st.st_mtim.tv_nsec;
+  EDITOR.dirty = false;
+  editor_set_status_message("%zu bytes written", length + 
+    (INDEX.running ? INDEX.length - INDEX.appended : 0));
+  free(chars);
+  free(name);
+  free(target);
+  return 0;
+
+fatal:
+  editor_set_status_message("Can't save: %s", strerror(errno));
+  if (fd != -1) {
+    close(fd);
+    unlink(name);
+  }
+  free(chars);
+  free(name);
+  free(target);
+  return -1;
 }
 
 // "append buffer", to avoid flickering issues write all escape sequences to a 
-// buffer and flush them to stdout in a single call
+// buffer and flush them to stdout in a single call. The capacity doubles when
+// it runs out, so appends are amortized O(1)
+#define BUFFER_INITIAL_CAPACITY 4096
+
 typedef struct buffer {
   char *b;
   int length;
+  int capacity;
 } buffer;
 
 void buffer_append(buffer *ab, const char *s, int length) {
-  char *new = realloc(ab->b, ab->length + length);
+  if (ab->length + length > ab->capacity) {
+    int capacity = ab->capacity ? ab->capacity : BUFFER_INITIAL_CAPACITY;
+    char *new;
 
-  if (new == NULL) return;
+    while (capacity < ab->length + length) capacity *= 2;
+    if ((new = stats_realloc(ab->b, capacity)) == NULL) return;
+    ab->b = new;
+    ab->capacity = capacity;
+  }
 
-  memcpy(new + ab->length, s, length);
-  ab->b = new;
+  memcpy(ab->b + ab->length, s, length);
   ab->length += length;
 }
 
+// Buffers are arenas reused from one frame to the next: destroying one only
+// forgets its content, the memory is kept for the next frame
 void buffer_destroy(buffer *ab) {
-  free(ab->b);
+  ab->length = 0;
 }
 
-// Writes the whole screen using VT100 escape characters from the logical state
-// of the editor stored in EDITOR
-void screen_refresh(void) {
-  row *r;
-  char buf[32];
-  buffer ab = {NULL, 0};
+// Cells of the screen grids
+int screen_resize(screen *s, int rows, int columns) {
+  uint32_t *chars = stats_realloc(s->chars, rows * columns * sizeof(*chars));
+  unsigned char *attributes;
+
+  if (chars == NULL) return -1;
+  s->chars = chars;
+  attributes = stats_realloc(s->attributes, rows * columns);
+  if (attributes == NULL) return -1;
+  s->attributes = attributes;
+  s->rows = rows;
+  s->columns = columns;
+  return 0;
+}
+
+// Blank count cells from at
+void screen_blank(screen *s, int at, int count) {
+  for (int i = 0; i < count; i++) s->chars[at + i] = ' ';
+  memset(s->attributes + at, CELL_NORMAL, count);
+}
+
+void screen_clear(screen *s) {
+  screen_blank(s, 0, s->rows * s->columns);
+}
+
+// Lay out length chars of a line at row y. The first of them is at column of
+// the rendering, which shows from column start on. A TAB takes the columns to
+// the next multiple of 8, a multibyte char its width, a combining char joins
+// the char before it when its bytes fit in the cell. Control chars, and bytes
+// that are not a char, show in one cell the other way round from attribute,
+// ^A as A, DEL as ?: a CR at the end of a CRLF line shows as M. Returns the
+// column after the chars, the ones past the right margin are not looked at.
+int screen_put_text(screen *s, int y, const char *chars, size_t length,
+                    int column, int start, unsigned char attribute) {
+  const char *end = chars + length;
+  uint32_t *cells = s->chars + y * s->columns;
+  unsigned char *attributes = s->attributes + y * s->columns;
+  unsigned char other = attribute == CELL_NORMAL ? CELL_REVERSE : CELL_NORMAL;
+
+  if (y >= s->rows) return column;
+  while (chars < end && column - start < s->columns) {
+    int x = column - start, bytes, width;
+    unsigned char c = *chars, cell_attribute = attribute;
+    uint32_t cell = c, codepoint;
+
+    width = render_char_width(chars, end - chars, column, &bytes);
+    if (c == TAB) {
+      for (int i = 0; i < width && x + i < s->columns; i++) {
+        cells[x + i] = ' ';
+        attributes[x + i] = attribute;
+      }
+    } else if (c < ' ' || c == 0x7f) {
+      cells[x] = c == 0x7f ? '?' : '@' + c;
+      attributes[x] = other;
+    } else if (c & 0x80) {
+      if (bytes == 1 || (utf8_decode(chars, bytes, &codepoint), 
+                         codepoint < 0xa0)) {
+        // not a char, or a C1 control
+        cell = '?';
+        cell_attribute = other;
+      } else {
+        cell = 0;
+        for (int i = bytes - 1; i >= 0; i--) {
+          cell = cell << 8 | (unsigned char)chars[i];
+        }
+      }
+      if (width == 0) {
+        int at = x - 1;
+
+        if (at >= 0 && cells[at] == CELL_WIDE) at--;
+        if (at >= 0) {
+          int used = cells[at] > 0xffffff ? 4 : cells[at] > 0xffff ? 3 
+                                              : cells[at] > 0xff ? 2 : 1;
+          if (used + bytes <= 4) cells[at] |= cell << (8 * used);
+        }
+      } else if (x + width > s->columns) {
+        // a wide char cut by the margin leaves a blank
+        cells[x] = ' ';
+        attributes[x] = attribute;
+      } else {
+        cells[x] = cell;
+        attributes[x] = cell_attribute;
+        if (width == 2) {
+          cells[x + 1] = CELL_WIDE;
+          attributes[x + 1] = cell_attribute;
+        }
+      }
+    } else {
+      cells[x] = c;
+      attributes[x] = attribute;
+    }
+    column += width;
+    chars += bytes;
+  }
+  return column;
+}
+
+// Write the length chars at y/x, clipped to the right margin
+void screen_put(screen *s, int y, int x, const char *chars, int length, 
+                unsigned char attribute) {
+  if (length > 0) screen_put_text(s, y, chars, length, x, 0, attribute);
+}
 
-  buffer_append(&ab, "\x1b[?25l", 6);   // hide the cursor
-  buffer_append(&ab, "\x1b[H", 3);      // go home
+// Lay out the editor state in s, as the terminal should show it
+void screen_compose(screen *s) {
+  row *r;
 
+  screen_clear(s);
   for (int y = 0; y < EDITOR.screen_rows; y++) {
     int file_row = EDITOR.row_offset + y;
 
     if (file_row >= EDITOR.row_count) {
+      screen_put(s, y, 0, "~", 1, CELL_NORMAL);
       if (EDITOR.row_count == 0 && y == (EDITOR.screen_rows / 3)) {
         char welcome[80];
         int welcome_length = snprintf(welcome, sizeof(welcome), 
-          "Common Lisp mINimal Editor -- v%s\x1b[0K\r\n", CLINE_VERSION);
+          "Common Lisp mINimal Editor -- v%s", CLINE_VERSION);
         int padding = (EDITOR.screen_columns - welcome_length) / 2;
-        if (padding) {
-          buffer_append(&ab, "~", 1);
-          padding--;
-        }
-        while (padding--) buffer_append(&ab, " ", 1);
-        buffer_append(&ab, welcome, welcome_length);
-      } else {
-        buffer_append(&ab, "~\x1b[0K\r\n", 7);
+        if (padding < 1) padding = 1;
+        screen_put(s, y, padding, welcome, welcome_length, CELL_NORMAL);
       }
       continue;
     }
 
-    r = &EDITOR.rows[file_row];
+    if (file_row == LINE.line) {
+      // the line being edited is laid out from both sides of its gap, which
+      // does not move
+      size_t from = EDITOR.column_offset, before = LINE.gap_start;
+      size_t after = LINE.capacity - LINE.gap_end;
+      int start = editor_start_column(file_row), column = start;
 
-    int len = r->rendered_size - EDITOR.column_offset;
-    if (len > 0) {
-      if (len > EDITOR.screen_columns) len = EDITOR.screen_columns;
-      char *c = r->rendered_chars + EDITOR.column_offset;
-      for (int j = 0; j < len; j++) {
-        buffer_append(&ab, c + j, 1);
+      if (from < before) {
+        column = screen_put_text(s, y, LINE.chars + from, before - from,
+                                 column, start, CELL_NORMAL);
+        from = before;
+      }
+      if (from - before < after) {
+        screen_put_text(s, y, LINE.chars + LINE.gap_end + (from - before),
+                        after - (from - before), column, start, CELL_NORMAL);
       }
+      continue;
     }
+    r = editor_row(file_row);
+    if (EDITOR.column_offset < r->size) {
+      int start = editor_start_column(file_row);
 
-    buffer_append(&ab, "\x1b[39m", 5);
-    buffer_append(&ab, "\x1b[0K", 4);
-    buffer_append(&ab, "\r\n", 2);
+      screen_put_text(s, y, r->chars + EDITOR.column_offset,
+                      r->size - EDITOR.column_offset, start, start,
+                      CELL_NORMAL);
+    }
   }
 
   // status rows
   // first row
-  buffer_append(&ab, "\x1b[0K", 4);
-  buffer_append(&ab, "\x1b[7m", 4);
-
+  int y = EDITOR.screen_rows;
   char status[80], rstatus[80];
-  int len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
-    EDITOR.filename, EDITOR.row_count, EDITOR.dirty ? "(modified)": "");
+  int len;
+  if (INDEX.running) {
+    len = snprintf(status, sizeof(status), "%.20s - indexing... %d%% %s",
+      EDITOR.filename, (int)(INDEX.appended * 100 / INDEX.length),
+      EDITOR.dirty ? "(modified)": "");
+  } else {
+    len = snprintf(status, sizeof(status), "%.20s - %d lines %s", 
+      EDITOR.filename, EDITOR.row_count, EDITOR.dirty ? "(modified)": "");
+  }
   int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
     EDITOR.row_offset + EDITOR.cursor_y + 1, EDITOR.row_count);
-  
-  if (len > EDITOR.screen_columns) len = EDITOR.screen_columns;
-  buffer_append(&ab, status, len);
-  
-  while (len < EDITOR.screen_columns) {
-    if (EDITOR.screen_columns - len == rlen) {
-      buffer_append(&ab, rstatus, rlen);
-      break;
-    } else {
-      buffer_append(&ab, " ", 1);
-      len++;
+
+  memset(s->attributes + y * s->columns, CELL_REVERSE, s->columns);
+  screen_put(s, y, 0, status, len, CELL_REVERSE);
+  if (len + rlen <= s->columns) {
+    screen_put(s, y, s->columns - rlen, rstatus, rlen, CELL_REVERSE);
+  }
+
+  // second row depends on status message, or shows the debug overlay
+  if (STATS.overlay) {
+    char overlay[128];
+    int overlay_length = snprintf(overlay, sizeof(overlay),
+      "render %.2fms  %dB  latency %.1fms  %.2f reads/key  %lld allocs",
+      STATS.render_time / 1000.0, EDITOR.frame_bytes, STATS.latency / 1000.0,
+      STATS.frame_keys ? (double)STATS.frame_reads / STATS.frame_keys : 0.0,
+      STATS.frame_allocations);
+    screen_put(s, y + 1, 0, overlay, overlay_length, CELL_NORMAL);
+  } else {
+    screen_put(s, y + 1, 0, EDITOR.status_message, 
+               strlen(EDITOR.status_message), CELL_NORMAL);
+  }
+}
+
+// What the terminal is at while a frame is written: its cursor, 0 based, y
+// is -1 when not known, and the attribute of the chars written
+typedef struct output {
+  int y;
+  int x;
+  unsigned char attribute;
+} output;
+
+static output OUTPUT = {-1, -1, CELL_NORMAL};
+
+void screen_set_attribute(buffer *ab, unsigned char attribute) {
+  if (OUTPUT.attribute == attribute) return;
+  if (attribute == CELL_REVERSE) {
+    buffer_append(ab, "\x1b[7m", 4);
+  } else {
+    buffer_append(ab, "\x1b[0m", 4);
+  }
+  OUTPUT.attribute = attribute;
+}
+
+// Write the chars of count cells at the cursor, the right halves of wide chars
+// come with their left ones: the cursor moves by count columns, whatever the
+// bytes. Past the last column it is lost
+void screen_write(buffer *ab, const uint32_t *cells, int count, int columns) {
+  for (int i = 0; i < count; i++) {
+    char bytes[4];
+    int length = 0;
+
+    for (uint32_t cell = cells[i]; cell != 0; cell >>= 8) {
+      bytes[length++] = cell & 0xff;
     }
+    buffer_append(ab, bytes, length);
+  }
+  OUTPUT.x += count;
+  if (OUTPUT.x >= columns) OUTPUT.y = -1;
+}
+
+bool screen_cell_same(screen *a, screen *b, int at) {
+  return a->chars[at] == b->chars[at] && a->attributes[at] == b->attributes[at];
+}
+
+// Append a move by count along final (CUU, CUD, CUF or CUB) to s
+int screen_relative_move(char *s, int count, char final) {
+  if (count == 1) return sprintf(s, "\x1b[%c", final);
+  return sprintf(s, "\x1b[%d%c", count, final);
+}
+
+// Move the cursor to column x of row y with the fewest bytes: an absolute
+// move, or from where the cursor is, or from the first column after a CR, LFs
+// or a relative move up or down then BSs, a relative move or writing again
+// the chars shown on the way. Cells being columns, the moves count cells. The
+// chars written again must be plain ASCII, a column each, in the current
+// attribute, and show the same in shown and frame unless the row is drawn
+// already.
+void screen_move(buffer *ab, screen *shown, screen *frame, int y, int x,
+                 bool drawn) {
+  char best[48], candidate[48];
+  int best_length, dy = y - OUTPUT.y, columns = frame->columns;
+
+  if (OUTPUT.y == y && OUTPUT.x == x) return;
+  if (x == 0) {
+    best_length = y == 0 ? sprintf(best, "\x1b[H") 
+                         : sprintf(best, "\x1b[%dH", y + 1);
+  } else {
+    best_length = sprintf(best, "\x1b[%d;%dH", y + 1, x + 1);
   }
-  buffer_append(&ab, "\x1b[0m\r\n", 6);
 
-  // second row depends on status message
-  buffer_append(&ab, "\x1b[0K", 4);
-  int status_length = strlen(EDITOR.status_message);
-  if (status_length > 0) {
-    int l = status_length > EDITOR.screen_columns 
-      ? status_length 
-      : EDITOR.screen_columns;
-    buffer_append(&ab, EDITOR.status_message, l);
+  for (int cr = 0; cr <= 1 && OUTPUT.y != -1; cr++) {
+    int length = 0, from = cr ? 0 : OUTPUT.x, dx = x - from;
+
+    if (cr) candidate[length++] = '\r';
+    // LF keeps the column, there is no output post processing
+    if (dy > 0 && dy <= 3) {
+      while (length < cr + dy) candidate[length++] = '\n';
+    } else if (dy != 0) {
+      length += screen_relative_move(candidate + length, abs(dy), 
+                                     dy > 0 ? 'B' : 'A');
+    }
+    if (dx < 0 && dx >= -3) {
+      for (int i = 0; i < -dx; i++) candidate[length++] = '\b';
+    } else if (dx < 0) {
+      length += screen_relative_move(candidate + length, -dx, 'D');
+    } else if (dx > 0) {
+      int at = y * columns + from, n = 0;
+      int move_length = screen_relative_move(candidate + length, dx, 'C');
+      uint32_t *chars = frame->chars + at;
+
+      // writing the chars instead costs a byte each
+      while (n < dx && n < move_length && chars[n] >= ' ' && chars[n] <= '~' &&
+             frame->attributes[at + n] == OUTPUT.attribute &&
+             (drawn || screen_cell_same(shown, frame, at + n))) {
+        n++;
+      }
+      if (n == dx) {
+        for (int i = 0; i < n; i++) candidate[length++] = chars[i];
+      } else {
+        length += move_length;
+      }
+    }
+    if (length < best_length) {
+      memcpy(best, candidate, length);
+      best_length = length;
+    }
   }
+  buffer_append(ab, best, best_length);
+  OUTPUT.y = y;
+  OUTPUT.x = x;
+}
 
-  // put cursor at its current position. the cursor position may be different
-  // than the value of EDITOR.cursor_x because of TABs
-  int cx = 1;
-  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
-  row *row = (file_row >= EDITOR.row_count) ? NULL : &EDITOR.rows[file_row];
-  if (row) {
-    int cursor_column = EDITOR.cursor_x + EDITOR.column_offset; 
-    for (int j = EDITOR.column_offset; j < cursor_column; j++) {
-      if (j < row->size && row->chars[j] == TAB) cx += 7 - ((cx) % 8);
-      cx++;
+// Append to ab the escape sequences turning the terminal showing shown into
+// frame: the cells that differ are written in runs, the cursor moving between
+// them as cheaply as screen_move can, and trailing blanks are erased
+void screen_draw(buffer *ab, screen *shown, screen *frame) {
+  int columns = frame->columns;
+
+  for (int y = 0; y < frame->rows; y++) {
+    int at = y * columns;
+    uint32_t *new = frame->chars + at;
+    unsigned char *new_attributes = frame->attributes + at;
+    int first = 0, last = columns - 1, end = columns, limit;
+
+    while (first < columns && screen_cell_same(shown, frame, at + first)) {
+      first++;
+    }
+    if (first == columns) continue;
+    while (screen_cell_same(shown, frame, at + last)) last--;
+
+    // trailing blanks are cleared by an erase to the end of line
+    while (end > first && new[end - 1] == ' ' && 
+           new_attributes[end - 1] == CELL_NORMAL) end--;
+
+    limit = last < end - 1 ? last : end - 1;
+    for (int x = first, stop; x <= limit; x = stop) {
+      if (screen_cell_same(shown, frame, at + x)) {
+        stop = x + 1;
+        continue;
+      }
+      // never write half of a wide char
+      while (x > 0 && new[x] == CELL_WIDE) x--;
+      stop = x + 1;
+      while (stop < columns && 
+             (new[stop] == CELL_WIDE || 
+              (stop <= limit && !screen_cell_same(shown, frame, at + stop)))) {
+        stop++;
+      }
+
+      screen_move(ab, shown, frame, y, x, false);
+      for (int run; x < stop; x += run) {
+        run = 1;
+        while (x + run < stop && new_attributes[x + run] == new_attributes[x]) {
+          run++;
+        }
+        screen_set_attribute(ab, new_attributes[x]);
+        screen_write(ab, new + x, run, columns);
+      }
+    }
+    if (last >= end) {
+      screen_move(ab, shown, frame, y, end, false);
+      screen_set_attribute(ab, CELL_NORMAL);
+      buffer_append(ab, "\x1b[K", 3);
     }
   }
-  snprintf(buf, sizeof(buf), "\x1b[%d;%dH", EDITOR.cursor_y + 1, cx);
-  buffer_append(&ab, buf, strlen(buf));
-  buffer_append(&ab, "\x1b[?25h", 6);   // show cursor
-  write(STDOUT_FILENO, ab.b, ab.length);
+  screen_set_attribute(ab, CELL_NORMAL);
+}
 
-  buffer_destroy(&ab);
+bool screen_row_equal(screen *a, int a_y, screen *b, int b_y) {
+  int columns = a->columns;
+
+  return memcmp(a->chars + a_y * columns, b->chars + b_y * columns,
+                columns * sizeof(*a->chars)) == 0 &&
+    memcmp(a->attributes + a_y * columns, b->attributes + b_y * columns,
+           columns) == 0;
 }
 
-// Use the ESC [6n escape sequence to query the horizontal cursor position
-// and return it. On error, -1 is returned. On success, the position of the
-// cursor is stored at *rows and *columns and 0 is returned
-int cursor_get_position(int input_fd, int output_fd, int *rows, int *columns) {
-  char buffer[32];
-  unsigned int i = 0;
-  
-  // report cursor location
-  if (write(output_fd, "\x1b[6n", 4) != 4) return -1;
+// When the text moved by delta lines (up when positive) and more of its rows
+// match the frame once moved, have the terminal scroll them inside a scroll
+// region over the text rows, and move the rows of shown along: screen_draw
+// then only paints the rows exposed. Returns true when scrolled, leaving the
+// cursor home.
+bool screen_scroll(buffer *ab, screen *shown, screen *frame, int delta) {
+  int rows = EDITOR.screen_rows, columns = frame->columns;
+  int count = abs(delta), kept = 0, same = 0, blank;
+  char buf[32];
 
-  // read the response: ESC [ rows ; cols R
-  while (i < sizeof(buffer) - 1) {
-    if (read(input_fd, buffer + 1, 1) != 1) break;
-    if (buffer[i] == 'R') break;
-    i++;
+  if (delta == 0 || count >= rows) return false;
+  for (int y = 0; y < rows; y++) {
+    if (y + delta >= 0 && y + delta < rows &&
+        screen_row_equal(shown, y + delta, frame, y)) {
+      kept++;
+    }
+    if (screen_row_equal(shown, y, frame, y)) same++;
   }
-  buffer[i] = '\0';
+  if (kept <= same) return false;
 
-  // parse it
-  if (buffer[0] != ESC || buffer[1] == '[') return -1;
-  if (sscanf(buffer + 2, "%d;%d", rows, columns) != 2) return -1;
-  
-  return 0;
+  snprintf(buf, sizeof(buf), "\x1b[1;%dr\x1b[%d%c\x1b[r", rows, count,
+           delta > 0 ? 'S' : 'T');
+  buffer_append(ab, buf, strlen(buf));
+  if (delta > 0) {
+    memmove(shown->chars, shown->chars + count * columns,
+            (rows - count) * columns * sizeof(*shown->chars));
+    memmove(shown->attributes, shown->attributes + count * columns,
+            (rows - count) * columns);
+    blank = rows - count;
+  } else {
+    memmove(shown->chars + count * columns, shown->chars,
+            (rows - count) * columns * sizeof(*shown->chars));
+    memmove(shown->attributes + count * columns, shown->attributes,
+            (rows - count) * columns);
+    blank = 0;
+  }
+  screen_blank(shown, blank * columns, count * columns);
+  OUTPUT.y = OUTPUT.x = 0;
+  return true;
 }
 
-int screen_get_size(int input_fd, int output_fd, int *rows, int *columns) {
-  struct winsize window_size;
+// Bring the terminal up to date with the logical state of the editor stored in
+// EDITOR. A shadow copy of what the terminal shows is kept, so that only the
+// cells that changed since the last frame are written, vertical scrolls are
+// left to the terminal. Once the buffer and the grids have grown to the size
+// of a frame, refreshing does no allocation.
+void screen_refresh(void) {
+  static buffer ab = {NULL, 0, 0};
+  screen *frame = &EDITOR.frame, *shown = &EDITOR.shown;
+  int rows = EDITOR.screen_rows + 2;
+
+  if (frame->rows != rows || frame->columns != EDITOR.screen_columns) {
+    if (screen_resize(frame, rows, EDITOR.screen_columns) == -1 ||
+        screen_resize(shown, rows, EDITOR.screen_columns) == -1) {
+      return;
+    }
+    EDITOR.shown_valid = false;
+  }
+
+  // a synchronized update makes the terminal show the frame at once, when
+  // it is complete. hide the cursor
+  const char *begin = EDITOR.synchronized_output ? "\x1b[?2026h\x1b[?25l" 
+                                                 : "\x1b[?25l";
+  int begin_length = strlen(begin);
+  buffer_append(&ab, begin, begin_length);
+  int length = ab.length;
 
-  int found = ioctl(1, TIOCGWINSZ, &window_size);
-  if (found == -1 || window_size.ws_col == 0) {
-    // ioctl() failed. query the terminal
-    int original_row, original_column, return_value;
+  if (!EDITOR.shown_valid) {
+    // start from a known, blank, terminal
+    buffer_append(&ab, "\x1b[0m\x1b[H\x1b[2J", 11);
+    screen_clear(shown);
+    OUTPUT.y = OUTPUT.x = 0;
+    OUTPUT.attribute = CELL_NORMAL;
+    EDITOR.shown_valid = true;
+  }
+
+  screen_compose(frame);
+  if (EDITOR.full_redraw) {
+    // no cell matches, every row is written again from its first column
+    memset(shown->attributes, 0xff, shown->rows * shown->columns);
+  }
+  if (!EDITOR.full_redraw) {
+    screen_scroll(&ab, shown, frame, 
+                  EDITOR.row_offset - EDITOR.shown_row_offset);
+  }
+  screen_draw(&ab, shown, frame);
+  bool painted = ab.length > length;
+  if (!painted) ab.length -= begin_length;   // only the cursor moves
 
-    // get the initial position so we can restore it later
-    return_value = 
-      cursor_get_position(input_fd, output_fd, &original_row, &original_column);
-    if (return_value == -1) return -1;
+  // put cursor at its current position. the cursor position may be different
+  // than the value of EDITOR.cursor_x because of TABs and multibyte chars
+  int cx = 1;
+  int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+  if (file_row < EDITOR.row_count) {
+    int cursor_column = EDITOR.cursor_x + EDITOR.column_offset; 
 
-    // go to the right/bottom margin and get the position
-    if (write(output_fd, "\x1b[999C\x1b[999B", 12) != 12) return -1;
-    return_value = 
-      cursor_get_position(input_fd, output_fd, &original_row, &original_column);
-    if (return_value == -1) return -1;
+    cx += editor_cursor_column(file_row, cursor_column) -
+      editor_start_column(file_row);
+  }
 
-    // restore position
-    char sequence[32];
-    snprintf(sequence, 32, "\x1b[%d;%dH", original_row, original_column);
-    if (write(output_fd, sequence, strlen(sequence)) == -1) {
-      // not recoverable
+  screen_move(&ab, shown, frame, EDITOR.cursor_y, cx - 1, true);
+  if (ab.length > 0) {
+    if (painted) buffer_append(&ab, "\x1b[?25h", 6);   // show cursor
+    if (painted && EDITOR.synchronized_output) {
+      buffer_append(&ab, "\x1b[?2026l", 8);
     }
-    return 0;
+    write(STDOUT_FILENO, ab.b, ab.length);
+    EDITOR.frame_bytes = ab.length;
+  } else {
+    EDITOR.frame_bytes = 0;
+  }
+  EDITOR.shown_cursor_x = cx;
+  EDITOR.shown_cursor_y = EDITOR.cursor_y + 1;
+  EDITOR.shown_row_offset = EDITOR.row_offset;
+
+  // the terminal now shows the frame
+  screen swap = *shown;
+  *shown = *frame;
+  *frame = swap;
+
+  buffer_destroy(&ab);
+}
+
+// Size of the terminal as the kernel knows it, -1 when it does not
+int screen_get_size(int *rows, int *columns) {
+  struct winsize window_size;
+
+  if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &window_size) == -1 ||
+      window_size.ws_col == 0) {
+    return -1;
   }
   *columns = window_size.ws_col;
   *rows = window_size.ws_row;
   return 0;
 }
 
+// When the kernel does not know the size, screen_query_terminal asks the
+// terminal. Until it answers, the size stays as it is, 24x80 at first.
 void screen_update_size(void) {
-  if (screen_get_size(STDIN_FILENO, STDOUT_FILENO, 
-                      &EDITOR.screen_rows, &EDITOR.screen_columns) == -1) {
-    perror("Unable to query the screen size (rows/columns)");
-    exit(1);
+  int rows = 24, columns = 80;
+
+  EDITOR.size_unknown = screen_get_size(&rows, &columns) == -1;
+  if (EDITOR.size_unknown) {
+    if (INPUT.position_row > 0) {
+      rows = INPUT.position_row;
+      columns = INPUT.position_column;
+    } else if (EDITOR.screen_columns > 0) {
+      return;
+    }
   }
-  EDITOR.screen_rows -= 2;
+  EDITOR.screen_rows = rows - 2;
+  EDITOR.screen_columns = columns;
+}
+
+// Ask the terminal, all at once, what only it can tell: its size when the
+// kernel does not know it (the cursor is moved to the bottom right corner and
+// its position reported, then restored), whether it does synchronized updates
+// (DECRQM of mode 2026) and the kitty keyboard protocol, and last its
+// attributes (DA1), that every terminal answers. The replies come through
+// the input decoder, see input_on_reply, nothing waits for them.
+void screen_query_terminal(void) {
+  char query[64];
+  int length = 0;
+
+  if (EDITOR.size_unknown) {
+    length += sprintf(query + length, "\x1b" "7\x1b[999;999H\x1b[6n\x1b" "8");
+    INPUT.position_asked = true;
+  }
+  if (!EDITOR.synchronized_forced) {
+    length += sprintf(query + length, "\x1b[?2026$p");
+  }
+  length += sprintf(query + length, "\x1b[?u\x1b[c");
+  write(STDOUT_FILENO, query, length);
 }
 
 #define CLINE_QUITE_TIMES 3
+#define CLINE_FRAME_INTERVAL 16   // ms between frames, CLINE_FRAME_MS overrides
+
+// Insert a bracketed paste. Terminals send line ends as CR, the text
+// gets them as '\n'
+void editor_on_paste(char *s, size_t length) {
+  size_t j = 0;
+
+  for (size_t i = 0; i < length; i++) {
+    if (s[i] == '\r') {
+      if (i + 1 < length && s[i + 1] == '\n') continue;
+      s[j++] = '\n';
+    } else {
+      s[j++] = s[i];
+    }
+  }
+  editor_insert_text(s, j);
+}
+
+void editor_set_prompt(void) {
+  snprintf(EDITOR.status_message, sizeof(EDITOR.status_message), 
+           "Go to line: %.*s", EDITOR.prompt_length, EDITOR.prompt);
+}
+
+// Keys typed while the line number is prompted: digits, BACKSPACE, ENTER to
+// go, ESC to give up
+void editor_on_prompt_keypress(int c) {
+  switch (c) {
+  case ENTER:
+    EDITOR.prompt[EDITOR.prompt_length] = '\0';
+    if (EDITOR.prompt_length > 0) editor_go_to_line(atoi(EDITOR.prompt));
+    // fall through
+  case ESC:
+    EDITOR.prompting = false;
+    EDITOR.status_message[0] = '\0';
+    return;
+  case BACKSPACE:
+  case DEL:
+    if (EDITOR.prompt_length > 0) EDITOR.prompt_length--;
+    break;
+  default:
+    if (c >= '0' && c <= '9' && 
+        EDITOR.prompt_length < (int)sizeof(EDITOR.prompt) - 1) {
+      EDITOR.prompt[EDITOR.prompt_length++] = c;
+    }
+  }
+  editor_set_prompt();
+}
 
-// Process events arriving from standard input (user typing in the terminal)
-void editor_on_keypress(int input_fd) {
+// Process a key arriving from standard input (user typing in the terminal)
+void editor_on_keypress(int c) {
   static int quit_times = CLINE_QUITE_TIMES;
 
-  int c = editor_read_key(input_fd);
+  // the terminal told its size, see screen_query_terminal
+  if (c == CURSOR_POSITION) {
+    EDITOR.size_changed = true;
+    return;
+  }
+  // the ESC quitting are in a row, another key takes their warning back
+  if ((c != ESC || EDITOR.prompting) && quit_times != CLINE_QUITE_TIMES) {
+    quit_times = CLINE_QUITE_TIMES;
+    EDITOR.status_message[0] = '\0';
+  }
+  if (EDITOR.prompting) {
+    editor_on_prompt_keypress(c);
+    return;
+  }
+  // moves with modifiers move all the same, other keys with modifiers do
+  // nothing
+  if (c & KEY_MODIFIERS) {
+    if ((c & ~KEY_MODIFIERS) < ARROW_LEFT) return;
+    c &= ~KEY_MODIFIERS;
+  }
+
   switch (c) {
+  case CTRL_KEY('t'):
+    STATS.overlay = !STATS.overlay;
+    break;
+  case CTRL_KEY('z'):
+  case CTRL_KEY('y'):
+    editor_undo(c == CTRL_KEY('y'));
+    break;
+  case CTRL_KEY('s'):
+    editor_save();
+    break;
+  case CTRL_KEY('g'):
+    EDITOR.prompting = true;
+    EDITOR.prompt_length = 0;
+    editor_set_prompt();
+    break;
   case ENTER:
-    // editor_insert_line();
+    editor_insert_line();
+    break;
+  case PASTE:
+    editor_on_paste(INPUT.paste, INPUT.paste_length);
     break;
   case BACKSPACE:
   case DEL:
-    // editor_delete_character();
+    editor_delete_character();
     break;
   case ARROW_UP:
   case ARROW_DOWN:
   case ARROW_LEFT:
   case ARROW_RIGHT:
-    // editor_move_cursor(c);
+  case HOME_KEY:
+  case END_KEY:
+  case PAGE_UP:
+  case PAGE_DOWN:
+    editor_move_cursor(c);
     break;
   case ESC:
     // on the third ESC hit, quit
-    if (quit_times > 1) {
-      quit_times--;
+    if (--quit_times > 0) {
+      if (EDITOR.dirty) {
+        editor_set_status_message("Unsaved changes, ESC %d more time%s quits "
+                                  "and loses them", quit_times, 
+                                  quit_times > 1 ? "s" : "");
+      }
       return;
     }
+    // quitting gives up the edits not saved, the user was warned
+    journal_stop();
     exit(0);
     break;
   default:
-    // editor_insert_character(c);
+    // function keys, mouse reports, control chars not bound... are not chars
+    if (c == TAB || (c >= ' ' && c < ARROW_LEFT)) editor_insert_character(c);
     break;
   }
 }
 
-void screen_on_resize(int unused __attribute__((unused))) {
-  screen_update_size();
-  if (EDITOR.cursor_y > EDITOR.screen_rows) {
-    EDITOR.cursor_y = EDITOR.screen_rows - 1;
+// Decode the input received and handle its keys. When timed_out, bytes left
+// are not the start of a sequence still arriving.
+void editor_handle_input(bool timed_out) {
+  int c;
+
+  // decoding pauses after a paste and when the key queue is full
+  do {
+    input_decode(timed_out);
+    if (INPUT.key_tail == INPUT.key_head) break;
+    while ((c = input_next_key()) != -1) editor_on_keypress(c);
+    screen_schedule_refresh();
+  } while (INPUT.ring_tail != INPUT.ring_head);
+}
+
+#define CLINE_ESC_TIMEOUT 100   // ms to wait for the rest of an escape sequence
+
+void editor_on_escape_timeout(void) {
+  editor_handle_input(true);
+}
+
+// The terminal is gone, SIGHUP being ignored or not sent: keep the edits in
+// the journal, to be recovered, and leave rather than poll a dead terminal
+void editor_on_hang_up(void) {
+  journal_flush();
+  exit(1);
+}
+
+// The terminal has input: read everything it has and handle it
+void editor_on_input(int input_fd) {
+  long long start = stats_now(), keys = STATS.keys;
+  bool hung_up = EVENTS.revents & (POLLHUP | POLLERR | POLLNVAL);
+  int nread, reads = 0;
+
+  if (STATS.input_time == 0) STATS.input_time = start;
+  event_timer_stop(editor_on_escape_timeout);
+  do {
+    if ((nread = input_fill(input_fd)) == -1) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      editor_on_hang_up();
+    }
+    // ready with nothing to read, and room for it, is the end of the input
+    if (nread == 0 && reads == 0 && 
+        INPUT.ring_head - INPUT.ring_tail < INPUT_RING_SIZE) {
+      hung_up = true;
+    }
+    reads++;
+    editor_handle_input(false);
+  } while (nread > 0);
+  if (hung_up) editor_on_hang_up();
+
+  // an escape sequence cut short is a lone ESC unless the rest shows up soon
+  if (INPUT.ring_tail != INPUT.ring_head && !INPUT.pasting) {
+    event_timer_start(editor_on_escape_timeout, CLINE_ESC_TIMEOUT);
   }
-  if (EDITOR.cursor_x > EDITOR.screen_columns) {
-    EDITOR.cursor_x = EDITOR.screen_rows - 1;
+  stats_trace("input", start, stats_now() - start, "keys", STATS.keys - keys);
+}
+
+// Draw the frame scheduled by screen_schedule_refresh
+void screen_on_frame(void) {
+  static long long reads, keys;
+  long long start = stats_now(), allocations = STATS.allocations, end;
+
+  EDITOR.frame_scheduled = false;
+  if (EDITOR.size_changed) {
+    int file_row = EDITOR.row_offset + EDITOR.cursor_y;
+    int file_column = EDITOR.column_offset + EDITOR.cursor_x;
+
+    EDITOR.size_changed = false;
+    screen_update_size();
+    editor_set_cursor(file_row, file_column);
   }
   screen_refresh();
+  end = stats_now();
+  EDITOR.last_frame = end / 1000;
+  STATS.render_time = end - start;
+  STATS.latency = STATS.input_time ? end - STATS.input_time : 0;
+  STATS.input_time = 0;
+  STATS.frame_reads = STATS.reads - reads;
+  STATS.frame_keys = STATS.keys - keys;
+  STATS.frame_allocations = STATS.allocations - allocations;
+  reads = STATS.reads;
+  keys = STATS.keys;
+  stats_trace("frame", start, STATS.render_time, "bytes", EDITOR.frame_bytes);
+}
+
+// Ask for the screen to be drawn again. All the changes made until the frame
+// is drawn are coalesced in it: the first change after a quiet period is drawn
+// at once, during a burst frames come at most once per EDITOR.frame_interval.
+void screen_schedule_refresh(void) {
+  long long wait;
+
+  if (EDITOR.frame_scheduled) return;
+  EDITOR.frame_scheduled = true;
+  wait = EDITOR.last_frame + EDITOR.frame_interval - stats_now() / 1000;
+  event_timer_start(screen_on_frame, wait > 0 ? wait : 0);
+}
+
+// SIGWINCH comes in bursts while a window is dragged, the size is only queried
+// when the next frame is drawn
+void screen_on_resize(void) {
+  EDITOR.size_changed = true;
+  screen_schedule_refresh();
 }
 
 void editor_init(void) {
@@ -387,20 +3932,56 @@ void editor_init(void) {
   EDITOR.column_offset = 0;
   EDITOR.row_count = 0;
   EDITOR.rows = NULL;
+  EDITOR.row_cache_size = 0;
+  EDITOR.shown_valid = false;
+  EDITOR.frame_interval = CLINE_FRAME_INTERVAL;
+  EDITOR.frame_scheduled = false;
+  EDITOR.last_frame = 0;
+  EDITOR.size_changed = false;
+  scan_init();
+  text_init(&EDITOR.text, NULL, 0);
   EDITOR.dirty = false;
   EDITOR.filename = NULL;
+  EDITOR.prompting = false;
+  HISTORY.memory_max = HISTORY_MEMORY;
 
-  screen_update_size();
-  signal(SIGWINCH, screen_on_resize);
+  char *frame_ms = getenv("CLINE_FRAME_MS");
+  if (frame_ms && atoi(frame_ms) >= 0) EDITOR.frame_interval = atoi(frame_ms);
+  char *undo_memory = getenv("CLINE_UNDO_MEMORY");
+  if (undo_memory && atol(undo_memory) > 0) {
+    HISTORY.memory_max = atol(undo_memory);
+  }
+  char *journal_ms = getenv("CLINE_JOURNAL_MS");
+  if (journal_ms && atoi(journal_ms) > 0) JOURNAL.interval = atoi(journal_ms);
+  if (getenv("CLINE_TRACE")) stats_trace_open(getenv("CLINE_TRACE"));
+  EDITOR.full_redraw = getenv("CLINE_FULL_REDRAW") != NULL;
 }
 
-int main(void) {
+int main(int argc, char **argv) {
   editor_init();
+  screen_update_size();
+  event_signal(SIGWINCH, screen_on_resize);
+  event_watch(STDIN_FILENO, editor_on_input);
+  if (argc >= 2) {
+    long long start = stats_now();
+
+    if (editor_open(argv[1]) == -1) {
+      perror("Unable to open the file");
+      exit(1);
+    }
+    stats_trace("open", start, stats_now() - start, "lines", EDITOR.row_count);
+  }
   enable_raw_mode(STDIN_FILENO);
 
-  while (1) {
-    screen_refresh();
-    editor_on_keypress(STDIN_FILENO);
+  // CLINE_SYNC_OUTPUT=0 or 1 overrides what the terminal answers
+  char *synchronized = getenv("CLINE_SYNC_OUTPUT");
+  if (synchronized) {
+    EDITOR.synchronized_output = atoi(synchronized) != 0;
+    EDITOR.synchronized_forced = true;
   }
+  screen_query_terminal();
+
+  screen_schedule_refresh();
+  while (1) event_loop_once();
   return 0;
 }